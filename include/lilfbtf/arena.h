@@ -0,0 +1,119 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LILFBTF5_ARENA_H
+#define LILFBTF5_ARENA_H
+
+#include <blt/std/types.h>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace fb
+{
+    /**
+     * Arena shared by every tree of a population. Each thread bump allocates out of its own slab, so building trees from many
+     * threads only takes a lock when a thread runs out of space. Nothing is freed individually, instead reset() releases every
+     * allocation at once, such as a whole generation of trees. The slabs themselves are kept until the arena is destroyed, so a
+     * generation no larger than the one before it allocates nothing.
+     * A thread remembers its slab for the last four concurrent arenas it allocated from, switching between more than that leaves
+     * the rest of a slab unused on every switch. Arenas only ever used by one thread at a time should not be concurrent.
+     */
+    class tree_arena_t
+    {
+        public:
+            // the part of a slab which has not been allocated yet
+            struct cursor_t
+            {
+                blt::u8* current = nullptr;
+                blt::u8* end = nullptr;
+            };
+        private:
+            struct slab_t
+            {
+                blt::u8* memory;
+                blt::size_t size;
+            };
+            
+            blt::size_t slab_size;
+            // concurrent arenas keep a slab per thread, the others bump allocate from a single cursor kept in the arena
+            bool concurrent;
+            cursor_t local;
+            // changes on reset, letting threads know the slab they were allocating from is gone
+            blt::u64 id;
+            std::mutex slab_mutex;
+            // slabs before next_slab have been handed out since the last reset, the rest are kept for reuse
+            std::vector<slab_t> slabs;
+            blt::size_t next_slab = 0;
+            
+            // takes a free slab able to fit bytes, allocating one if none is left, which the cursor then allocates from
+            void* allocate_slow(cursor_t& cursor, blt::size_t bytes, blt::size_t alignment);
+        
+        public:
+            /**
+             * @param concurrent allow many threads to allocate at once. Without it the arena must only be used by one thread at a time,
+             * but never loses the rest of its slab to other arenas, which suits arenas owned by a single tree
+             */
+            explicit tree_arena_t(blt::size_t slab_size = 64 * 1024, bool concurrent = true);
+            
+            tree_arena_t(const tree_arena_t&) = delete;
+            
+            tree_arena_t& operator=(const tree_arena_t&) = delete;
+            
+            void* allocate(blt::size_t bytes, blt::size_t alignment = alignof(std::max_align_t));
+            
+            template<typename T, typename... ARGS>
+            inline T* emplace(ARGS&& ... args)
+            { return new(allocate(sizeof(T), alignof(T))) T(std::forward<ARGS>(args)...); }
+            
+            template<typename T>
+            inline T* emplace_many(blt::size_t count)
+            {
+                auto* memory = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+                for (blt::size_t i = 0; i < count; i++)
+                    new(&memory[i]) T();
+                return memory;
+            }
+            
+            template<typename T>
+            inline void destroy(T* ptr)
+            { ptr->~T(); }
+            
+            // memory is only given back by reset(), kept so the arena can be used in place of the other allocators
+            template<typename T>
+            inline void deallocate(T*, blt::size_t = 1)
+            {}
+            
+            /**
+             * Releases every allocation made from this arena in constant time, keeping the slabs for the allocations which follow.
+             * Nothing may be allocating from the arena while it is reset, and nothing allocated from it can be used afterwards.
+             */
+            void reset();
+            
+            /**
+             * @return the number of bytes reserved by the slabs of this arena, including slabs kept by reset()
+             */
+            [[nodiscard]] blt::size_t reserved();
+            
+            ~tree_arena_t();
+    };
+}
+
+#endif //LILFBTF5_ARENA_H
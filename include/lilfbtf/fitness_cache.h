@@ -0,0 +1,142 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LILFBTF5_FITNESS_CACHE_H
+#define LILFBTF5_FITNESS_CACHE_H
+
+#include <lilfbtf/fwddecl.h>
+#include <blt/std/hashmap.h>
+#include <blt/std/types.h>
+#include <array>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <vector>
+
+namespace fb
+{
+    enum class eviction_t
+    {
+        // evicts the entry which was found or inserted the longest time ago
+        LRU,
+        // evicts the entry which was inserted the longest time ago, lookups do not reorder the entries
+        FIFO
+    };
+    
+    /**
+     * Bounded cache of fitness results keyed by the structural hash of a tree, see tree_t::hash(). Entries are spread over
+     * shards with their own lock, so many threads can look up and insert results at once.
+     */
+    class fitness_cache_t
+    {
+        private:
+            static constexpr blt::size_t SHARD_COUNT = 16;
+            
+            struct entry_t
+            {
+                blt::u64 hash;
+                detail::fitness_results fitness;
+                std::vector<float> errors;
+            };
+            
+            struct shard_t
+            {
+                std::mutex mutex;
+                blt::size_t capacity = 0;
+                // most recently used or inserted first, the back is evicted
+                std::list<entry_t> entries;
+                blt::hashmap_t<blt::u64, std::list<entry_t>::iterator> lookup;
+            };
+            
+            std::array<shard_t, SHARD_COUNT> shards;
+            // capacities below SHARD_COUNT only use as many shards as there are entries, so no shard is left without room
+            blt::size_t active_shards = 1;
+            blt::size_t total_capacity = 0;
+            eviction_t policy = eviction_t::LRU;
+            std::atomic<blt::u64> hit_count = 0;
+            std::atomic<blt::u64> miss_count = 0;
+            std::atomic<blt::u64> eviction_count = 0;
+            
+            // scales the top bits of the hash onto the active shards, the hashes are well mixed so they spread evenly over them
+            inline shard_t& shard_of(blt::u64 hash)
+            { return shards[((hash >> 32) * active_shards) >> 32]; }
+        
+        public:
+            explicit fitness_cache_t(blt::size_t capacity = 0, eviction_t policy = eviction_t::LRU);
+            
+            fitness_cache_t(const fitness_cache_t&) = delete;
+            
+            fitness_cache_t& operator=(const fitness_cache_t&) = delete;
+            
+            /**
+             * Drops every entry and changes the number of entries kept by the cache, a capacity of 0 disables it.
+             * Entries are evicted per shard, so with more than one shard an evicted entry is the oldest of its shard rather than of
+             * the whole cache. Must not be called while other threads are using the cache.
+             */
+            void configure(blt::size_t capacity, eviction_t eviction);
+            
+            /**
+             * Looks up the results of a tree, copying its case errors into errors. An entry recorded with a different number of
+             * case errors than errors can hold counts as a miss.
+             * @return true if the tree was found
+             */
+            bool find(blt::u64 hash, detail::fitness_results& fitness, blt::span<float> errors);
+            
+            /**
+             * Records the results of a tree, evicting an entry of its shard when the shard is full. Replaces any existing entry.
+             */
+            void insert(blt::u64 hash, const detail::fitness_results& fitness, blt::span<const float> errors);
+            
+            /**
+             * Drops every entry, for example when the fitness cases change. The counters are left untouched.
+             */
+            void clear();
+            
+            inline void reset_counters()
+            {
+                hit_count = 0;
+                miss_count = 0;
+                eviction_count = 0;
+            }
+            
+            [[nodiscard]] inline bool enabled() const
+            { return total_capacity > 0; }
+            
+            [[nodiscard]] inline blt::size_t capacity() const
+            { return total_capacity; }
+            
+            [[nodiscard]] inline eviction_t eviction() const
+            { return policy; }
+            
+            /**
+             * @return number of entries currently in the cache
+             */
+            [[nodiscard]] blt::size_t size();
+            
+            [[nodiscard]] inline blt::u64 hits() const
+            { return hit_count; }
+            
+            [[nodiscard]] inline blt::u64 misses() const
+            { return miss_count; }
+            
+            [[nodiscard]] inline blt::u64 evictions() const
+            { return eviction_count; }
+    };
+}
+
+#endif //LILFBTF5_FITNESS_CACHE_H
@@ -24,6 +24,8 @@
 #include <functional>
 #include "blt/std/ranges.h"
 #include <string>
+#include <cstring>
+#include <utility>
 
 namespace fb
 {
@@ -37,6 +39,13 @@ namespace fb
     
     class gp_population_t;
     
+    class random;
+    
+    // no way we are going to have more than 4billion types or functions.
+    using type_id = blt::u32;
+    using function_id = blt::u32;
+    using arg_c_t = blt::size_t;
+    
     namespace detail
     {
         class node_t;
@@ -51,20 +60,98 @@ namespace fb
         {
             // reference to ourselves
             func_t& self;
-            // list of arguments to use
-            blt::span<detail::node_t*> arguments;
+            // slots holding the arguments, in argument order. independent of the tree storage layout.
+            // every slot contains a plain value of the argument's type as described by its type_layout_t
+            blt::span<const blt::u8* const> arguments;
+            // slot to write our output into, never aliases any of the arguments. terminals find the constant from their initializer here
+            blt::u8* result;
             // any extra information that the tree evaluator wants to provide to us, in the case of an image GP this is going to be the X and Y coords
             blt::unsafe::buffer_any_t extra_args;
+            
+            /**
+             * @tparam T type the argument was registered with, using type_engine_t::register_type<T>
+             * @return the value of the argument at index
+             */
+            template<typename T>
+            [[nodiscard]] inline T get(blt::size_t index) const
+            {
+                T value;
+                std::memcpy(&value, arguments[index], sizeof(T));
+                return value;
+            }
+            
+            /**
+             * Writes our output, T must always be given explicitly so the value is converted to the registered type before being stored
+             * @tparam T type our output type was registered with
+             */
+            template<typename T, typename U>
+            inline void set(U&& value) const
+            {
+                T converted = std::forward<U>(value);
+                std::memcpy(result, &converted, sizeof(T));
+            }
+        };
+        
+        /**
+         * A contiguous run of values of a single type, one value per fitness case.
+         */
+        class column_t
+        {
+            private:
+                blt::u8* data_ = nullptr;
+                blt::size_t size_ = 0;
+                blt::size_t stride_ = 0;
+                type_id type_ = 0;
+            public:
+                column_t() = default;
+                
+                column_t(blt::u8* data, blt::size_t size, blt::size_t stride, type_id type):
+                        data_(data), size_(size), stride_(stride), type_(type)
+                {}
+                
+                template<typename T>
+                [[nodiscard]] inline blt::span<T> as() const
+                { return {reinterpret_cast<T*>(data_), size_}; }
+                
+                [[nodiscard]] inline blt::u8* at(blt::size_t index) const
+                { return data_ + index * stride_; }
+                
+                [[nodiscard]] inline blt::u8* data() const
+                { return data_; }
+                
+                // number of values (fitness cases) in this column
+                [[nodiscard]] inline blt::size_t size() const
+                { return size_; }
+                
+                // size of a single value in bytes
+                [[nodiscard]] inline blt::size_t stride() const
+                { return stride_; }
+                
+                [[nodiscard]] inline type_id type() const
+                { return type_; }
+        };
+        
+        struct func_t_batch_arguments
+        {
+            // reference to ourselves, terminals can read the constant produced by their initializer from here
+            func_t& self;
+            // one column per argument, in argument order
+            blt::span<const column_t> arguments;
+            // column to write our output into, never aliases any of the arguments
+            const column_t& result;
+            // the extra information for every fitness case, in the same order as the columns
+            blt::span<const blt::unsafe::buffer_any_t> extra_args;
         };
     }
     
-    // no way we are going to have more than 4billion types or functions.
-    using type_id = blt::u32;
-    using function_id = blt::u32;
-    using arg_c_t = blt::size_t;
     using func_t_call_t = std::function<void(const detail::func_t_arguments&)>;
-    using func_t_init_t = std::function<void(func_t&)>;
-    using fitness_eval_func_t = std::function<detail::fitness_results(detail::node_t*)>;
+    using func_t_call_ptr_t = void (*)(const detail::func_t_arguments&);
+    using func_t_batch_call_t = std::function<void(const detail::func_t_batch_arguments&)>;
+    // initializers are given the random stream of the tree being constructed, trees may be constructed from many threads at once
+    using func_t_init_t = std::function<void(func_t&, random&)>;
+    using fitness_eval_func_t = std::function<detail::fitness_results(tree_t&)>;
+    // writes the error of an individual on every fitness case, lower is better
+    using case_error_func_t = std::function<void(tree_t&, blt::span<float> errors)>;
     using individual_eval_func_t = std::function<void(tree_t&)>;
     using function_name = const std::string&;
     using type_name = const std::string&;
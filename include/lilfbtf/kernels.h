@@ -0,0 +1,85 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LILFBTF5_KERNELS_H
+#define LILFBTF5_KERNELS_H
+
+#include <lilfbtf/fwddecl.h>
+#include <blt/std/types.h>
+
+/**
+ * Column kernels for the u8 primitives of the image GP, along with the kernels used by lexicase selection. Every kernel
+ * processes count values at once using the widest instruction set supported by the running cpu, falling back to plain loops
+ * when there is none. Arithmetic wraps around like it does on u8, bools are stored as a single byte containing 0 or 1.
+ */
+namespace fb::kernels
+{
+    enum class simd_level_t
+    {
+        SCALAR, SSE2, AVX2
+    };
+    
+    /**
+     * @return the instruction set selected for the running cpu, this is only detected once.
+     */
+    simd_level_t simd_level();
+    
+    void add_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    void sub_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    void mul_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    // division by zero produces zero
+    void div_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    void and_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    void or_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    void less_u8(const blt::u8* a, const blt::u8* b, bool* out, blt::size_t count);
+    
+    void greater_u8(const blt::u8* a, const blt::u8* b, bool* out, blt::size_t count);
+    
+    // out = cond ? a : b
+    void if_u8(const bool* cond, const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+    
+    // smallest of count values, count must not be zero. values must not be NaN
+    float min_f32(const float* values, blt::size_t count);
+    
+    /**
+     * Writes the position of every value less than or equal to threshold to out, in increasing order.
+     * out must have room for count positions.
+     * @return the number of positions written
+     */
+    blt::size_t filter_f32(const float* values, blt::size_t count, float threshold, blt::u32* out);
+    
+    // batched implementations of the kernels, to be used with type_engine_t::associate_batch
+    // the u8 and bool types must be registered using register_type<blt::u8> and register_type<bool>
+    extern const func_t_batch_call_t add_u8_batch;
+    extern const func_t_batch_call_t sub_u8_batch;
+    extern const func_t_batch_call_t mul_u8_batch;
+    extern const func_t_batch_call_t div_u8_batch;
+    extern const func_t_batch_call_t and_u8_batch;
+    extern const func_t_batch_call_t or_u8_batch;
+    extern const func_t_batch_call_t less_u8_batch;
+    extern const func_t_batch_call_t greater_u8_batch;
+    extern const func_t_batch_call_t if_u8_batch;
+}
+
+#endif //LILFBTF5_KERNELS_H
@@ -0,0 +1,261 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LILFBTF5_PRIMITIVE_SET_H
+#define LILFBTF5_PRIMITIVE_SET_H
+
+#include <lilfbtf/fwddecl.h>
+#include <lilfbtf/tree.h>
+#include <lilfbtf/type.h>
+#include <array>
+#include <tuple>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fb
+{
+    template<typename... TYPES>
+    struct type_list_t
+    {};
+    
+    namespace detail
+    {
+        template<typename T, typename... TYPES>
+        struct index_of;
+        
+        template<typename T, typename... TYPES>
+        struct index_of<T, T, TYPES...> : std::integral_constant<blt::size_t, 0>
+        {};
+        
+        template<typename T, typename U, typename... TYPES>
+        struct index_of<T, U, TYPES...> : std::integral_constant<blt::size_t, 1 + index_of<T, TYPES...>::value>
+        {};
+        
+        template<typename T>
+        struct index_of<T>
+        {
+            static_assert(!std::is_same_v<T, T>, "Type used by a primitive was not declared in the primitive set's type list!");
+        };
+        
+        template<typename T, typename... TYPES>
+        inline constexpr blt::size_t index_of_v = index_of<T, TYPES...>::value;
+        
+        // std::vector<bool> is a bitset, so bools are kept as bytes on the value stacks
+        template<typename T>
+        using stack_value_t = std::conditional_t<std::is_same_v<T, bool>, blt::u8, T>;
+    }
+    
+    /**
+     * Wraps a function pointer as a primitive of a primitive_set_t, the argument and return types are deduced from its signature.
+     * A leading blt::unsafe::buffer_any_t parameter receives the extra arguments of the fitness case instead of a subtree.
+     * For example primitive_t<&test_add_function_t::call<double>> is a two argument double primitive.
+     */
+    template<auto FUNC, typename = decltype(FUNC)>
+    struct primitive_t;
+    
+    template<auto FUNC, typename R, typename... ARGS>
+    struct primitive_t<FUNC, R(*)(ARGS...)>
+    {
+        using return_t = R;
+        using arguments_t = type_list_t<std::decay_t<ARGS>...>;
+        
+        template<typename... VALUES>
+        static inline R call(const detail::flat_node_t&, blt::unsafe::buffer_any_t, VALUES&& ... values)
+        { return FUNC(std::forward<VALUES>(values)...); }
+        
+        static void scalar(const detail::func_t_arguments& args)
+        { unpack_scalar(args, std::index_sequence_for<ARGS...>{}); }
+        
+        template<blt::size_t... INDEX>
+        static inline void unpack_scalar(const detail::func_t_arguments& args, std::index_sequence<INDEX...>)
+        { args.set<R>(FUNC(args.get<std::decay_t<ARGS>>(INDEX)...)); }
+        
+        static inline std::optional<std::reference_wrapper<const func_t_init_t>> initializer()
+        { return {}; }
+    };
+    
+    template<auto FUNC, typename R, typename... ARGS>
+    struct primitive_t<FUNC, R(*)(blt::unsafe::buffer_any_t, ARGS...)>
+    {
+        using return_t = R;
+        using arguments_t = type_list_t<std::decay_t<ARGS>...>;
+        
+        template<typename... VALUES>
+        static inline R call(const detail::flat_node_t&, blt::unsafe::buffer_any_t extra_args, VALUES&& ... values)
+        { return FUNC(extra_args, std::forward<VALUES>(values)...); }
+        
+        static void scalar(const detail::func_t_arguments& args)
+        { unpack_scalar(args, std::index_sequence_for<ARGS...>{}); }
+        
+        template<blt::size_t... INDEX>
+        static inline void unpack_scalar(const detail::func_t_arguments& args, std::index_sequence<INDEX...>)
+        { args.set<R>(FUNC(args.extra_args, args.get<std::decay_t<ARGS>>(INDEX)...)); }
+        
+        static inline std::optional<std::reference_wrapper<const func_t_init_t>> initializer()
+        { return {}; }
+    };
+    
+    /**
+     * Terminal producing a constant of type T, which is generated by INIT when the node is constructed and stored inside the node.
+     */
+    template<typename T, T (* INIT)(random&)>
+    struct constant_t
+    {
+        using return_t = T;
+        using arguments_t = type_list_t<>;
+        
+        static inline const func_t_init_t init = [](func_t& self, random& engine) {
+            self.setValue(INIT(engine));
+        };
+        
+        static inline T call(const detail::flat_node_t& node, blt::unsafe::buffer_any_t)
+        { return node.value.any_cast<T>(); }
+        
+        // the evaluator places the value set by the initializer in the result slot before calling terminals
+        static void scalar(const detail::func_t_arguments&)
+        {}
+        
+        static inline std::optional<std::reference_wrapper<const func_t_init_t>> initializer()
+        { return std::cref(init); }
+    };
+    
+    /**
+     * A set of types and primitives known at compile time. The set registers itself with a type_engine_t, so trees are still
+     * constructed and evaluated as usual, but can also evaluate trees using tree_storage_t::FLAT through a jump table specialized
+     * for the set. Every primitive is inlined into its table entry and reads its arguments from typed value stacks, one per type.
+     * @tparam TYPES type_list_t of every type used by the primitives, a type's index in the list is the index of its name
+     * @tparam PRIMITIVES primitive_t or constant_t
+     */
+    template<typename TYPES, typename... PRIMITIVES>
+    class primitive_set_t;
+    
+    template<typename... TYPES, typename... PRIMITIVES>
+    class primitive_set_t<type_list_t<TYPES...>, PRIMITIVES...>
+    {
+        public:
+            static constexpr blt::size_t type_count = sizeof...(TYPES);
+            static constexpr blt::size_t function_count = sizeof...(PRIMITIVES);
+        private:
+            using value_stacks_t = std::tuple<std::vector<detail::stack_value_t<TYPES>>...>;
+            using executor_t = void (*)(value_stacks_t& stacks, const detail::flat_node_t& node, blt::unsafe::buffer_any_t extra_args);
+            
+            std::array<type_id, type_count> type_ids{};
+            // function id -> index of the primitive in PRIMITIVES
+            std::vector<blt::size_t> function_to_primitive;
+            
+            template<typename T>
+            static inline T pop(value_stacks_t& stacks)
+            {
+                auto& stack = std::get<detail::index_of_v<T, TYPES...>>(stacks);
+                T value = static_cast<T>(stack.back());
+                stack.pop_back();
+                return value;
+            }
+            
+            template<typename T>
+            static inline void push(value_stacks_t& stacks, T value)
+            { std::get<detail::index_of_v<T, TYPES...>>(stacks).push_back(value); }
+            
+            template<typename PRIMITIVE, typename... ARGS>
+            static inline void execute(value_stacks_t& stacks, const detail::flat_node_t& node, blt::unsafe::buffer_any_t extra_args,
+                                       type_list_t<ARGS...>)
+            {
+                // walking the flat layout backwards leaves the first argument of each type on the top of its stack.
+                // braced initialization is always evaluated left to right, so arguments are popped in order.
+                std::tuple<ARGS...> args{pop<ARGS>(stacks)...};
+                push(stacks, std::apply([&node, extra_args](auto& ... values) {
+                    return PRIMITIVE::call(node, extra_args, values...);
+                }, args));
+            }
+            
+            template<typename PRIMITIVE>
+            static void execute(value_stacks_t& stacks, const detail::flat_node_t& node, blt::unsafe::buffer_any_t extra_args)
+            { execute<PRIMITIVE>(stacks, node, extra_args, typename PRIMITIVE::arguments_t{}); }
+            
+            template<typename... ARGS>
+            std::vector<std::string> argument_names(const std::array<std::string, type_count>& type_names, type_list_t<ARGS...>)
+            { return {type_names[detail::index_of_v<ARGS, TYPES...>]...}; }
+            
+            template<typename PRIMITIVE, typename... ARGS>
+            void register_primitive(type_engine_t& engine, const std::array<std::string, type_count>& type_names, const std::string& name,
+                                    blt::size_t index, type_list_t<ARGS...>)
+            {
+                const auto& output = type_names[detail::index_of_v<typename PRIMITIVE::return_t, TYPES...>];
+                function_id id;
+                if constexpr (sizeof...(ARGS) == 0)
+                    id = engine.register_terminal_function(name, output, &PRIMITIVE::scalar, PRIMITIVE::initializer());
+                else
+                {
+                    id = engine.register_function(name, output, &PRIMITIVE::scalar, sizeof...(ARGS), PRIMITIVE::initializer());
+                    engine.associate_input(name, argument_names(type_names, type_list_t<ARGS...>{}));
+                }
+                if (function_to_primitive.size() <= id)
+                    function_to_primitive.resize(id + 1);
+                function_to_primitive[id] = index;
+            }
+            
+            template<blt::size_t... INDEX>
+            void register_all(type_engine_t& engine, const std::array<std::string, type_count>& type_names,
+                              const std::array<std::string, function_count>& function_names, std::index_sequence<INDEX...>)
+            {
+                ((type_ids[detail::index_of_v<TYPES, TYPES...>] = engine.register_type<TYPES>(
+                        type_names[detail::index_of_v<TYPES, TYPES...>])), ...);
+                (register_primitive<PRIMITIVES>(engine, type_names, function_names[INDEX], INDEX, typename PRIMITIVES::arguments_t{}), ...);
+            }
+        
+        public:
+            primitive_set_t() = default;
+            
+            /**
+             * Registers every type and primitive of this set with the engine, including the argument types of every primitive.
+             * @param type_names names to register the types under, in the same order as TYPES
+             * @param function_names names to register the primitives under, in the same order as PRIMITIVES
+             */
+            void register_with(type_engine_t& engine, const std::array<std::string, type_count>& type_names,
+                               const std::array<std::string, function_count>& function_names)
+            { register_all(engine, type_names, function_names, std::index_sequence_for<PRIMITIVES...>{}); }
+            
+            [[nodiscard]] inline type_id get_type_id(blt::size_t index) const
+            { return type_ids[index]; }
+            
+            template<typename T>
+            [[nodiscard]] inline type_id get_type_id() const
+            { return type_ids[detail::index_of_v<T, TYPES...>]; }
+            
+            /**
+             * Evaluates a tree using tree_storage_t::FLAT which was constructed from the type engine this set was registered with.
+             * @tparam R the type produced by the root of the tree
+             */
+            template<typename R>
+            R evaluate(const tree_t& tree, blt::unsafe::buffer_any_t extra_args) const
+            {
+                static constexpr executor_t jump_table[] = {&execute<PRIMITIVES>...};
+                // value stacks are reused between calls, keeping them per thread allows evaluating from many threads at once
+                thread_local value_stacks_t stacks;
+                
+                auto nodes = tree.subtree(0);
+                for (blt::size_t i = nodes.size(); i-- > 0;)
+                    jump_table[function_to_primitive[nodes[i].function]](stacks, nodes[i], extra_args);
+                return pop<R>(stacks);
+            }
+    };
+}
+
+#endif //LILFBTF5_PRIMITIVE_SET_H
@@ -19,21 +19,109 @@
 #ifndef LILFBTF5_RANDOM_H
 #define LILFBTF5_RANDOM_H
 
-#include <random>
 #include <blt/std/types.h>
+#include "blt/std/ranges.h"
+#include <array>
+
+#if defined(_MSC_VER) && !defined(__SIZEOF_INT128__)
+    #include <intrin.h>
+#endif
 
 namespace fb
 {
+    namespace detail
+    {
+        // 64x64 -> 128 bit multiply out of 32 bit halves, for compilers without a 128 bit integer or an intrinsic
+        inline blt::u64 mul_hi64_portable(blt::u64 a, blt::u64 b, blt::u64& low)
+        {
+            const blt::u64 a_low = a & 0xFFFFFFFF, a_high = a >> 32;
+            const blt::u64 b_low = b & 0xFFFFFFFF, b_high = b >> 32;
+            const blt::u64 low_low = a_low * b_low;
+            const blt::u64 high_low = a_high * b_low;
+            // cannot overflow, at most (2^32 - 1) * 2 + (2^32 - 1)^2 = 2^64 - 1
+            const blt::u64 cross = (low_low >> 32) + (high_low & 0xFFFFFFFF) + a_low * b_high;
+            low = (cross << 32) | (low_low & 0xFFFFFFFF);
+            return (high_low >> 32) + (cross >> 32) + a_high * b_high;
+        }
+        
+        /**
+         * Full 128 bit product of a and b, used by the multiply and shift range reductions.
+         * @return the high 64 bits of the product, the low 64 bits are written to low
+         */
+        inline blt::u64 mul_hi64(blt::u64 a, blt::u64 b, blt::u64& low)
+        {
+#if defined(__SIZEOF_INT128__)
+            const auto m = static_cast<__uint128_t>(a) * b;
+            low = static_cast<blt::u64>(m);
+            return static_cast<blt::u64>(m >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+            blt::u64 high;
+            low = _umul128(a, b, &high);
+            return high;
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+            low = a * b;
+            return __umulh(a, b);
+#else
+            return mul_hi64_portable(a, b, low);
+#endif
+        }
+    }
+    
+    /**
+     * xoshiro256** generator, 32 bytes of state. Streams for other threads are derived using split(), which jumps the generator
+     * ahead by 2^128 values so the streams never overlap, or by constructing a generator from a seed and a stream number.
+     * The bulk fill functions use their own set of generators, stepped together so the compiler can vectorize them.
+     * An instance must only be used by one thread at a time.
+     */
     class random
     {
+        public:
+            static constexpr blt::size_t lanes = 4;
         private:
             blt::u64 seed;
-            std::mt19937_64 engine;
+            blt::u64 stream;
+            blt::u64 state[4];
+            // state of the bulk generators, lane_state[i][lane] is word i of a lane's state
+            alignas(32) blt::u64 lane_state[4][lanes];
+            
+            static inline blt::u64 rotl(blt::u64 x, int k)
+            { return (x << k) | (x >> (64 - k)); }
+            
+            // steps every lane once, writing one value per lane into out
+            void next_lanes(blt::u64* out);
+        
         public:
-            explicit random(blt::u64 seed);
+            explicit random(blt::u64 seed, blt::u64 stream = 0);
             
             void reset();
-            bool choice();
+            
+            /**
+             * Advances the generator by 2^128 values, equivalent to 2^128 calls to next(). Every bulk generator is advanced by
+             * the same amount, as if fill() had been called for 2^128 values per lane.
+             */
+            void jump();
+            
+            /**
+             * @return a generator continuing this stream, after which this generator jumps ahead to a stream that will not overlap it
+             */
+            random split();
+            
+            inline blt::u64 next()
+            {
+                const blt::u64 result = rotl(state[1] * 5, 7) * 9;
+                const blt::u64 t = state[1] << 17;
+                state[2] ^= state[0];
+                state[3] ^= state[1];
+                state[1] ^= state[2];
+                state[0] ^= state[3];
+                state[2] ^= t;
+                state[3] = rotl(state[3], 45);
+                return result;
+            }
+            
+            inline bool choice()
+            { return next() >> 63; }
+            
             bool choice(double d);
             bool chance(double chance = 0.5);
             
@@ -41,6 +129,75 @@ namespace fb
             double random_double(double min = 0, double max = 1);
             blt::u64 random_long(blt::u64 min = 0, blt::u64 max = 1);
             blt::i32 random_int(blt::i32 min = 0, blt::i32 max = 1);
+            
+            /**
+             * Fills out with raw 64 bit values from the bulk generators
+             */
+            void fill(blt::span<blt::u64> out);
+            
+            /**
+             * Fills out with uniform integers in [min, max]
+             */
+            void fill_long(blt::span<blt::u64> out, blt::u64 min = 0, blt::u64 max = 1);
+            
+            /**
+             * Fills out with uniform doubles in [min, max)
+             */
+            void fill_double(blt::span<double> out, double min = 0, double max = 1);
+            
+            /**
+             * Fills out with bernoulli draws, each true with probability d
+             */
+            void fill_choice(blt::span<bool> out, double d = 0.5);
+    };
+    
+    /**
+     * Hands out random values from a block generated with random::fill, which is refilled once used up.
+     * Used where many values with differing ranges are needed one at a time, such as the tree builders.
+     */
+    class random_buffer_t
+    {
+        private:
+            random& engine;
+            std::array<blt::u64, 64> values{};
+            blt::size_t index = values.size();
+            
+            inline blt::u64 next()
+            {
+                if (index == values.size())
+                {
+                    engine.fill({values.data(), values.size()});
+                    index = 0;
+                }
+                return values[index++];
+            }
+        
+        public:
+            explicit random_buffer_t(random& engine): engine(engine)
+            {}
+            
+            inline bool choice()
+            { return next() >> 63; }
+            
+            inline bool choice(double d)
+            { return static_cast<double>(next() >> 11) * 0x1.0p-53 < d; }
+            
+            // uniform integer in [min, max], see random::random_long
+            inline blt::u64 random_long(blt::u64 min = 0, blt::u64 max = 1)
+            {
+                const blt::u64 bound = max - min + 1;
+                if (bound == 0)
+                    return next();
+                blt::u64 low;
+                auto high = detail::mul_hi64(next(), bound, low);
+                if (low < bound)
+                {
+                    const blt::u64 threshold = -bound % bound;
+                    while (low < threshold)
+                        high = detail::mul_hi64(next(), bound, low);
+                }
+                return min + high;
+            }
     };
 }
 
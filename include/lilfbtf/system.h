@@ -20,8 +20,14 @@
 #define LILFBTF5_SYSTEM_H
 
 #include <lilfbtf/fwddecl.h>
+#include <lilfbtf/fitness_cache.h>
 #include <lilfbtf/tree.h>
 #include <blt/std/thread.h>
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <optional>
+#include <thread>
 #include <vector>
 
 namespace fb
@@ -32,28 +38,249 @@ namespace fb
         GROW, FULL, BRETT_GROW, RAMPED_HALF_HALF, RAMPED_TRI_HALF
     };
     
+    enum class selection_t
+    {
+        TOURNAMENT,
+        // requires the errors of every fitness case, see gp_population_t::execute
+        LEXICASE,
+        // lexicase keeping every individual within the median absolute deviation of the best error on a case
+        EPSILON_LEXICASE
+    };
+    
     class gp_population_t
     {
         private:
             blt::thread_pool<true>& pool;
-            std::vector<tree_t> population;
+            // number of threads in the pool, the pool does not expose this itself
+            blt::size_t thread_count;
+            struct generation_t
+            {
+                // every node of the generation is allocated from here, so it must outlive the trees
+                tree_arena_t arena;
+                std::vector<tree_t> population;
+            };
+            
+            // offspring are bred into the buffer not holding the current generation, after which the two are swapped
+            std::array<generation_t, 2> generations;
+            blt::size_t current = 0;
+            // fitness of the current generation as a structure of arrays, indexed like the population
+            struct scores_t
+            {
+                std::vector<double> fitness;
+                std::vector<blt::size_t> hits;
+                std::vector<blt::u32> sizes;
+                
+                inline void resize(blt::size_t size)
+                {
+                    fitness.resize(size);
+                    hits.resize(size);
+                    sizes.resize(size);
+                }
+                
+                [[nodiscard]] inline blt::size_t size() const
+                { return fitness.size(); }
+            } scores;
+            // errors of every individual on every fitness case, only recorded when execute() is given a case_error_func_t
+            struct case_errors_t
+            {
+                blt::size_t case_count = 0;
+                // individual major, each individual writes its own row during execute()
+                std::vector<float> rows;
+                // case major copy made before breeding, so the errors of a case over the whole population are contiguous
+                std::vector<float> columns;
+                // smallest error of every case over the whole population
+                std::vector<float> minimum;
+                // median absolute deviation of the errors of every case, used by epsilon lexicase
+                std::vector<float> epsilon;
+            } cases;
+            // execute only individuals with a unique structural hash, see tree_t::hash(). off unless enabled with set_deduplication()
+            bool deduplicate = false;
+            // results of previously executed structures, kept across generations. disabled until set_fitness_cache() is called
+            fitness_cache_t fitness_cache;
+            // the settings of the last init_pop, also used to grow the subtrees of mutations
+            struct
+            {
+                blt::size_t min_depth = 2;
+                blt::size_t max_depth = 6;
+                double terminal_chance = 0.5;
+            } growth;
+            // offspring deeper than this, as counted by tree_t::depth(), are replaced by a copy of their parent. 0 disables the limit
+            blt::size_t depth_limit = 17;
             fb::random& engine;
             type_engine_t& types;
             
-            std::pair<tree_t, tree_t> crossover(tree_t& p1, tree_t& p2);
+            inline generation_t& current_generation()
+            { return generations[current]; }
+            
+            inline generation_t& next_generation()
+            { return generations[1 - current]; }
+            
+            // destroys every tree of the generation and resets its arena, which releases their nodes without walking the trees
+            void release(generation_t& generation);
+            
+            // @return true if the tree is deeper than the depth limit
+            inline bool exceeds_depth_limit(tree_t& tree) const
+            { return depth_limit != 0 && tree.depth() > depth_limit; }
+            
+            /**
+             * Strongly typed subtree crossover, exchanging a uniformly selected subtree of p1 with a subtree of p2 producing the same type.
+             * The children are allocated in the next generation, when p2 has no node of the selected type they are copies of the parents.
+             * A child exceeding the depth limit is replaced by a copy of the parent it replaced a subtree of.
+             * @param second_child when false only the child of p1 is built, the second child is left empty
+             */
+            std::pair<tree_t, std::optional<tree_t>> crossover(tree_t& p1, tree_t& p2, fb::random& random, bool second_child = true);
+            
+            /**
+             * Applies one uniformly selected mutation_t to p in place, falling back to a subtree mutation when the selected
+             * operator cannot change the tree.
+             */
+            void mutate(tree_t& p, fb::random& random);
+            
+            /**
+             * Tournament selection over the scores of the current generation, the trees themselves are never touched.
+             * The individual with the highest fitness wins, ties are broken in favour of the smaller individual.
+             * @return index of the selected individual
+             */
+            blt::size_t select(fb::random& random, blt::size_t tournament_size);
+            
+            /**
+             * Lexicase selection over the case errors of the current generation. Cases are visited in a random order, each one
+             * keeping only the candidates with the lowest error, until a single candidate or no cases remain.
+             * @param epsilon keep every candidate within the epsilon of a case instead of only the best
+             * @return index of the selected individual
+             */
+            blt::size_t select_lexicase(fb::random& random, bool epsilon);
+            
+            // transposes the case errors into columns and computes the minimum and epsilon of every case
+            void prepare_lexicase();
+            
+            // copies the cached fitness and size of an individual of the current generation into the scores
+            void update_score(blt::size_t index);
             
-            tree_t mutate(tree_t& p);
+            /**
+             * Runs func on workers - 1 jobs of the pool and on the calling thread, which is always the last worker.
+             * Returns only once every job submitted to the pool has exited, then rethrows the first exception thrown by func if any.
+             * @param func called with the index of the worker running it
+             */
+            void run_on_pool(blt::size_t workers, const std::function<void(blt::size_t worker)>& func);
+            
+            /**
+             * Calls func over every index in [0, count), split into chunks which are claimed dynamically by the pool's threads and the
+             * calling thread.
+             * @param func called with the [begin, end) range of a chunk
+             */
+            void parallel_for(blt::size_t count, const std::function<void(blt::size_t begin, blt::size_t end)>& func);
+            
+            /**
+             * Calls func once for every index of costs, using work stealing for items whose cost varies by orders of magnitude.
+             * Items are dealt out to one queue per worker, most expensive first, and idle workers steal the cheaper half of the
+             * remaining items of another worker.
+             * @param costs estimated cost of every item, only their relative size matters
+             */
+            void parallel_for_by_cost(const std::vector<blt::size_t>& costs, const std::function<void(blt::size_t index)>& func);
         
         public:
-            explicit gp_population_t(blt::thread_pool<true>& pool, type_engine_t& types, fb::random& engine): pool(pool), engine(engine), types(types)
+            explicit gp_population_t(blt::thread_pool<true>& pool, type_engine_t& types, fb::random& engine,
+                                     blt::size_t thread_count = std::thread::hardware_concurrency()):
+                    pool(pool), thread_count(std::max<blt::size_t>(thread_count, 1)), engine(engine), types(types)
             {}
             
             void init_pop(population_init_t init_type, blt::size_t pop_size, blt::size_t min_depth, blt::size_t max_depth,
-                          std::optional<type_id> starting_type = {}, double terminal_chance = 0.5);
+                          std::optional<type_id> starting_type = {}, double terminal_chance = 0.5,
+                          tree_storage_t storage = tree_storage_t::POINTER);
             
+            /**
+             * Executes every individual of the current generation. When deduplication is enabled structurally identical individuals are
+             * only executed once, the others share its fitness and case errors without running either function.
+             * When the fitness cache is enabled it is consulted before executing an individual, whose tree is then never evaluated.
+             * An exception thrown by either function is rethrown once every thread has stopped, the scores are then incomplete.
+             */
             void execute(const individual_eval_func_t& individualEvalFunc, const fitness_eval_func_t& fitnessEvalFunc);
             
-            void breed_new_pop();
+            /**
+             * Executes the population, also recording the error of every individual on each fitness case for lexicase selection.
+             * @param case_count number of errors written by caseErrorFunc for every individual
+             * @param caseErrorFunc called after the fitness of an individual has been evaluated
+             */
+            void execute(const individual_eval_func_t& individualEvalFunc, const fitness_eval_func_t& fitnessEvalFunc, blt::size_t case_count,
+                         const case_error_func_t& caseErrorFunc);
+            
+            /**
+             * Breeds the next generation into the buffer of the previous one, which then becomes the current generation.
+             * Offspring are bred in parallel, each one is produced by crossover, mutation of a copy or reproduction of a selected parent.
+             * The parents are released in one go by resetting the arena their nodes were allocated from.
+             * @param crossover_chance share of the offspring produced by crossover, each crossover producing two of them
+             * @param mutation_chance share of the offspring produced by mutation, the remaining offspring are reproduced as is
+             * @param tournament_size number of individuals competing for every selected parent
+             * @param selection lexicase selection falls back to tournament selection when the last execute() recorded no case errors
+             * Offspring of crossover or mutation deeper than the depth limit are replaced by a copy of their parent, see set_depth_limit()
+             */
+            void breed_new_pop(double crossover_chance = 0.9, double mutation_chance = 0.1, blt::size_t tournament_size = 7,
+                               selection_t selection = selection_t::TOURNAMENT);
+            
+            /**
+             * Limits the depth of the offspring of crossover and mutation, which would otherwise grow without bound over the generations.
+             * Depths are counted like tree_t::depth(), the root being at depth 1. The default of 17 is the limit used by Koza,
+             * it must be at least the depth of the deepest initial tree for those trees to take part in crossover and mutation.
+             * @param limit maximum depth of an offspring, 0 removes the limit
+             */
+            inline gp_population_t& set_depth_limit(blt::size_t limit)
+            {
+                depth_limit = limit;
+                return *this;
+            }
+            
+            /**
+             * Enables executing structurally identical individuals only once, disabled by default. Deduplication assumes the fitness
+             * of an individual only depends on its structure, which does not hold when the functions depend on the extra data of the
+             * tree, on the results of its evaluation, or on anything changing between executions.
+             */
+            inline gp_population_t& set_deduplication(bool enabled)
+            {
+                deduplicate = enabled;
+                return *this;
+            }
+            
+            /**
+             * Enables the fitness cache, remembering the results of up to capacity structures across generations so individuals
+             * carried over unchanged, such as by reproduction, are not executed again. A capacity of 0 disables the cache.
+             * Like deduplication it assumes the fitness of an individual only depends on its structure, the cache must be cleared
+             * whenever the fitness cases or functions change.
+             */
+            inline gp_population_t& set_fitness_cache(blt::size_t capacity, eviction_t eviction = eviction_t::LRU)
+            {
+                fitness_cache.configure(capacity, eviction);
+                return *this;
+            }
+            
+            /**
+             * @return the fitness cache, for its hit and miss counters or to clear it
+             */
+            [[nodiscard]] inline fitness_cache_t& get_fitness_cache()
+            { return fitness_cache; }
+            
+            /**
+             * @return fitness of every individual as of the last execute(), indexed like the population
+             */
+            [[nodiscard]] inline const std::vector<double>& get_fitness() const
+            { return scores.fitness; }
+            
+            /**
+             * @return hits of every individual as of the last execute(), indexed like the population
+             */
+            [[nodiscard]] inline const std::vector<blt::size_t>& get_hits() const
+            { return scores.hits; }
+            
+            /**
+             * @return node count of every individual as of the last execute(), indexed like the population
+             */
+            [[nodiscard]] inline const std::vector<blt::u32>& get_sizes() const
+            { return scores.sizes; }
+            
+            /**
+             * Destroys every individual of the population, releasing all of their nodes at once.
+             */
+            void clear();
     };
     
     class gp_system_t
@@ -67,7 +294,7 @@ namespace fb
         private:
             type_engine_t& types;
     };
-    
+
 }
 
 #endif //LILFBTF5_SYSTEM_H
@@ -22,10 +22,14 @@
 #include <blt/std/any.h>
 #include <functional>
 #include "blt/std/ranges.h"
-#include "blt/std/allocator.h"
 #include "type.h"
+#include <lilfbtf/arena.h>
 #include <lilfbtf/fwddecl.h>
 #include <lilfbtf/random.h>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+#include <memory>
 
 namespace fb
 {
@@ -35,17 +39,18 @@ namespace fb
         private:
             arg_c_t argc_ = 0;
             type_id type;
+            // the function itself is looked up in the type engine's dispatch table
             function_id function;
-            const func_t_call_t& func;
         protected:
             blt::unsafe::any_t value;
         public:
-            explicit func_t(arg_c_t argc, const func_t_call_t& func, type_id output_type, function_id function_type);
+            explicit func_t(arg_c_t argc, type_id output_type, function_id function_type);
             
             [[nodiscard]] inline arg_c_t argc() const
             { return argc_; }
             
-            [[nodiscard]] inline blt::unsafe::any_t getValue() const
+            // the constant produced by the function initializer, the result of the function is only ever written to the value stacks
+            [[nodiscard]] inline const blt::unsafe::any_t& getValue() const
             { return value; }
             
             inline func_t& setValue(blt::unsafe::any_t val)
@@ -66,12 +71,15 @@ namespace fb
             [[nodiscard]] inline function_id getFunction() const
             { return function; }
             
-            inline void call(blt::span<detail::node_t*> args, blt::unsafe::buffer_any_t extra_args)
-            { func({*this, args, extra_args}); };
+            inline void call(const detail::type_snapshot_t& types, blt::span<const blt::u8* const> args, blt::u8* result,
+                             blt::unsafe::buffer_any_t extra_args)
+            { types.call(function, {*this, args, result, extra_args}); };
             
             ~func_t() = default;
     };
     
+    static_assert(std::is_trivially_copyable_v<func_t>, "func_t is copied into every node and must stay trivially copyable");
+    
     enum class tree_init_t
     {
         // standard koza grow method
@@ -82,61 +90,97 @@ namespace fb
         FULL
     };
     
+    enum class mutation_t
+    {
+        // replaces a subtree with a newly grown one
+        SUBTREE,
+        // swaps the function of a node for one with the same signature
+        POINT,
+        // promotes a subtree to the root of the tree
+        HOIST,
+        // replaces a subtree with a terminal
+        SHRINK,
+        // draws a new value for a constant
+        CONSTANT
+    };
+    
+    enum class tree_storage_t
+    {
+        // every node is individually allocated and linked to its children through pointers
+        POINTER,
+        // the whole tree is stored as one contiguous array of detail::flat_node_t in prefix order
+        FLAT
+    };
+    
     namespace detail
     {
         class node_t
         {
                 friend tree_t;
             private:
-                blt::bump_allocator<blt::BLT_2MB_SIZE, false>& alloc;
                 func_t type;
                 node_t** children = nullptr;
             public:
-                explicit node_t(const func_t& type, blt::bump_allocator<blt::BLT_2MB_SIZE, false>& alloc): alloc(alloc), type(type)
+                explicit node_t(const func_t& type, tree_arena_t& alloc): type(type)
                 {
                     children = alloc.emplace_many<node_t*>(this->type.argc());
                     for (blt::size_t i = 0; i < this->type.argc(); i++)
                         children[i] = nullptr;
                 }
                 
-                inline void evaluate(blt::unsafe::buffer_any_t extra_args)
-                {
-                    type.call(blt::span<node_t*>{children, type.argc()}, extra_args);
-                }
-                
-                inline blt::unsafe::any_t value()
+                inline const blt::unsafe::any_t& value() const
                 {
                     return type.getValue();
                 }
                 
-                ~node_t()
-                {
-                    for (blt::size_t i = 0; i < type.argc(); i++)
-                    {
-                        alloc.destroy(children[i]);
-                        alloc.deallocate(children[i]);
-                    }
-                    alloc.deallocate(children, type.argc());
-                }
+                ~node_t() = default;
         };
         
+        // nodes are never destroyed one by one, resetting the arena they were allocated from is the only teardown they get
+        static_assert(std::is_trivially_destructible_v<node_t>, "Pointer nodes must not own anything!");
+        
+        /**
+         * Compact node record used by the flat tree storage. The children of a node are stored directly after it,
+         * the first child at index + 1 and every following child at the end of the previous child's subtree.
+         */
+        struct flat_node_t
+        {
+            function_id function;
+            type_id type;
+            blt::u32 argc;
+            // number of nodes in the subtree rooted at this node, including itself
+            blt::u32 size;
+            // the constant produced by the function initializer
+            blt::unsafe::any_t value;
+        };
+        
+        static_assert(std::is_trivially_copyable_v<flat_node_t>);
+        
+        // the type engine is frozen on first use if it has not been already, see type_engine_t::snapshot()
         struct tree_construction_info_t
         {
             tree_init_t tree_type;
             random& engine;
             type_engine_t& types;
             double terminal_chance = 0.5;
+            tree_storage_t storage = tree_storage_t::POINTER;
+            // arena the nodes are allocated from, trees made without one allocate from a small arena of their own
+            tree_arena_t* arena = nullptr;
         };
         
         struct node_construction_info_t
         {
-            tree_t& tree;
+            // nodes are always generated in prefix order, they are only linked into the requested storage afterwards
+            std::vector<flat_node_t>& nodes;
+            // passed to function initializers
             random& engine;
-            type_engine_t& types;
+            // every choice made by the builders is drawn from here
+            random_buffer_t& randoms;
+            const type_snapshot_t& types;
             double terminal_chance;
             
-            node_construction_info_t(tree_t& tree, const tree_construction_info_t& info):
-                    tree(tree), engine(info.engine), types(info.types), terminal_chance(info.terminal_chance)
+            node_construction_info_t(std::vector<flat_node_t>& nodes, random_buffer_t& randoms, const tree_construction_info_t& info):
+                    nodes(nodes), engine(info.engine), randoms(randoms), types(info.types.snapshot()), terminal_chance(info.terminal_chance)
             {}
         };
         
@@ -145,22 +189,138 @@ namespace fb
             blt::unsafe::any_t value;
             type_id contained_type;
         };
+        
+        /**
+         * Contiguous stack of values of a single type, used by the evaluator instead of storing a value in every node.
+         * Every value takes exactly the size of its type_layout_t, so a stack of u8 is one byte per value.
+         */
+        struct value_stack_t
+        {
+            std::vector<blt::u8> memory;
+            blt::size_t stride = 0;
+            // number of values currently on the stack
+            blt::size_t size = 0;
+            
+            [[nodiscard]] inline blt::u8* at(blt::size_t index)
+            { return memory.data() + index * stride; }
+            
+            [[nodiscard]] inline const blt::u8* at(blt::size_t index) const
+            { return memory.data() + index * stride; }
+            
+            // makes room for one more value, existing values only move when this resizes the stack
+            inline void reserve_next()
+            {
+                if ((size + 1) * stride > memory.size())
+                    memory.resize(std::max((size + 1) * stride, memory.size() * 2));
+            }
+        };
     }
     
     class tree_t
     {
             friend gp_population_t;
         private:
-            inline blt::bump_allocator<blt::BLT_2MB_SIZE, false>& get_allocator()
-            { return alloc; }
+            inline tree_arena_t& get_allocator()
+            { return *alloc; }
             
             void recalculate_cache();
             
-            static detail::node_t* allocate_non_terminal(detail::node_construction_info_t info, type_id type);
+            void recalculate_type_index();
+            
+            void recalculate_hashes();
+            
+            [[nodiscard]] blt::u64 node_hash(const func_t& func) const;
+            
+            // hash of the subtree at a prefix order index, from its key and the hashes of its children
+            [[nodiscard]] blt::u64 combine_subtree(blt::size_t index) const;
+            
+            // rehashes every ancestor of the node at index after its subtree changed from old_size to new_size nodes
+            void rehash_ancestors(blt::size_t index, blt::u32 old_size, blt::u32 new_size);
+            
+            void evaluate_pointer(blt::unsafe::buffer_any_t extra_args);
+            
+            void evaluate_flat(blt::unsafe::buffer_any_t extra_args);
+            
+            // runs a single function, consuming its arguments from the top of the value stacks and pushing its result
+            void evaluate_node(func_t& func, blt::unsafe::buffer_any_t extra_args, bool reversed_arguments);
+            
+            // runs a single function over every fitness case, consuming its arguments from the top of the batch value stack
+            void evaluate_batch_node(func_t& func, blt::span<const blt::unsafe::buffer_any_t> fitness_cases, bool reversed_arguments);
+            
+            // takes ownership of prefix ordered nodes, linking them into the storage used by this tree. pointer nodes it replaces are
+            // left allocated in the arena
+            void store_nodes(std::vector<detail::flat_node_t>&& prefix_nodes);
+            
+            // invalidates every cache except the structural hashes, which the mutations keep up to date themselves
+            inline void invalidate_layout()
+            {
+                cache.dirty = true;
+                cache.type_index.dirty = true;
+            }
+            
+            // allocates pointer nodes for prefix ordered nodes
+            detail::node_t* link_nodes(const std::vector<detail::flat_node_t>& prefix_nodes);
+            
+            // the pointer referencing the node at a prefix order index, either root or a child of its parent
+            detail::node_t** find_node(blt::size_t index);
+            
+            func_t node_at(blt::size_t index);
+            
+            // replaces the function and constant of a node, func must take the same arguments as the node it replaces
+            void set_node(blt::size_t index, const func_t& func);
+            
+            // replaces the subtree rooted at a prefix order index with prefix ordered nodes, modifying the storage in place.
+            // with pointer storage the replaced nodes are unlinked but not freed, they stay live until the arena is reset
+            void replace_subtree(blt::size_t index, std::vector<detail::flat_node_t>&& subtree);
+            
+            // calls func with the prefix order index of every node and its function
+            template<typename FUNC>
+            void for_each_node(FUNC&& func) const
+            {
+                switch (storage)
+                {
+                    case tree_storage_t::POINTER:
+                    {
+                        std::vector<const detail::node_t*> stack{root};
+                        for (blt::size_t index = 0; !stack.empty(); index++)
+                        {
+                            const auto* node = stack.back();
+                            stack.pop_back();
+                            func(index, node->type);
+                            for (blt::size_t i = node->type.argc(); i-- > 0;)
+                                stack.push_back(node->children[i]);
+                        }
+                        break;
+                    }
+                    case tree_storage_t::FLAT:
+                        for (blt::size_t index = 0; index < nodes.size(); index++)
+                        {
+                            const auto& node = nodes[index];
+                            func_t node_func(node.argc, node.type, node.function);
+                            node_func.setValue(node.value);
+                            func(index, node_func);
+                        }
+                        break;
+                }
+            }
+            
+            // sets the size of the subtree of every node
+            static void calculate_sizes(std::vector<detail::flat_node_t>& prefix_nodes);
+            
+            // every node of the tree in prefix order with the size of its subtree, the same layout store_nodes() takes
+            [[nodiscard]] std::vector<detail::flat_node_t> prefix_nodes() const;
             
-            static detail::node_t* allocate_non_terminal_restricted(detail::node_construction_info_t info, type_id type);
+            // generates a tree in prefix order, rooted at a non-terminal of starting_type when one is given
+            static std::vector<detail::flat_node_t> generate(const detail::tree_construction_info_t& tree_info, blt::size_t min_depth,
+                                                             blt::size_t max_depth, std::optional<type_id> starting_type);
             
-            static detail::node_t* allocate_terminal(detail::node_construction_info_t info, type_id type);
+            static detail::flat_node_t make_node(detail::node_construction_info_t info, type_id type, function_id function);
+            
+            static detail::flat_node_t allocate_non_terminal(detail::node_construction_info_t info, type_id type);
+            
+            static detail::flat_node_t allocate_non_terminal_restricted(detail::node_construction_info_t info, type_id type);
+            
+            static detail::flat_node_t allocate_terminal(detail::node_construction_info_t info, type_id type);
             
             static void grow(detail::node_construction_info_t info, blt::size_t min_depth, blt::size_t max_depth);
             
@@ -168,31 +328,144 @@ namespace fb
             
             static void full(detail::node_construction_info_t info, blt::size_t depth);
             
-            explicit tree_t(type_engine_t& types);
+            explicit tree_t(type_engine_t& types, tree_storage_t storage, tree_arena_t* arena);
         public:
+            tree_t(const tree_t& copy) = delete;
+            
+            tree_t(tree_t&& move) noexcept;
+            
+            tree_t& operator=(const tree_t& copy) = delete;
+            
+            tree_t& operator=(tree_t&& move) = delete;
             
             static tree_t make_tree(detail::tree_construction_info_t tree_info, blt::size_t min_depth, blt::size_t max_depth,
                                     std::optional<type_id> starting_type = {});
             
+            /**
+             * Copies every node of this tree into a new tree using the same storage.
+             * @param arena arena the nodes of the copy are allocated from, when null the copy allocates from an arena of its own
+             */
+            [[nodiscard]] tree_t copy(tree_arena_t* arena = nullptr) const;
+            
             detail::tree_eval_t evaluate(blt::unsafe::buffer_any_t extra_args, const fitness_eval_func_t& fitnessEvalFunc);
             
+            /**
+             * Evaluates the tree over every fitness case at once. Each node is executed a single time over a whole column of values,
+             * using the function's batched implementation when one has been associated with the type engine.
+             * @return the column of values produced by the root, valid until the tree is evaluated or modified again
+             */
+            detail::column_t evaluate_batch(blt::span<const blt::unsafe::buffer_any_t> fitness_cases, const fitness_eval_func_t& fitnessEvalFunc);
+            
             blt::size_t depth();
             
-            // invalidates the internal cache, as the result of tree modification
+            blt::size_t node_count();
+            
+            /**
+             * @return a uniformly selected node index, in prefix order, which can be used as the root of a subtree operation
+             */
+            blt::size_t select_subtree(random& engine);
+            
+            /**
+             * @return a uniformly selected node index, in prefix order, along with the type produced by the node
+             */
+            std::pair<blt::size_t, type_id> select_typed_subtree(random& engine);
+            
+            // the mutations below never free the pointer nodes they replace. arena memory is only given back all at once, so a replaced
+            // subtree stays allocated until its arena is reset, for a population once per generation
+            
+            /**
+             * Replaces a uniformly selected subtree with a new subtree producing the same type, grown from the tree's arena.
+             * With probability terminal_chance the new subtree is a single terminal, otherwise it is grown from a non-terminal.
+             * @return true, a subtree can always be regenerated
+             */
+            bool mutate_subtree(random& engine, blt::size_t min_depth, blt::size_t max_depth, double terminal_chance = 0.5);
+            
+            /**
+             * Replaces the function of a uniformly selected node with another function producing the same type from the same
+             * argument types, keeping its children. The replacement is picked in proportion to the function weights.
+             * @return false when the selected node has no such alternative
+             */
+            bool mutate_point(random& engine);
+            
+            /**
+             * Replaces the tree with one of its proper subtrees producing the same type as the root.
+             * @return false when no node other than the root produces that type
+             */
+            bool mutate_hoist(random& engine);
+            
+            /**
+             * Replaces a uniformly selected non-terminal, and with it its whole subtree, with a terminal of the same type.
+             * @return false when no non-terminal has a terminal of its type
+             */
+            bool mutate_shrink(random& engine);
+            
+            /**
+             * Draws a new constant for a uniformly selected node which has an initializer. Constants are opaque to the tree,
+             * so the initializer is the only way of producing a new value for them.
+             * @return false when the tree holds no constants
+             */
+            bool mutate_constant(random& engine);
+            
+            /**
+             * Looked up in the type index of the tree, which is built on first use and kept until the tree is modified.
+             * @return the prefix order index of every node producing type, in increasing order
+             */
+            blt::span<const blt::u32> nodes_of_type(type_id type);
+            
+            /**
+             * Computed on first use and then updated by every mutation, without rehashing the rest of the tree.
+             * @return 64 bit structural hash of the functions, types and constants of the tree, structurally equal trees hash equally
+             */
+            blt::u64 hash();
+            
+            /**
+             * Only valid for trees using tree_storage_t::FLAT
+             * @return the contiguous range of nodes making up the subtree rooted at index
+             */
+            [[nodiscard]] inline blt::span<const detail::flat_node_t> subtree(blt::size_t index) const
+            { return {&nodes[index], nodes[index].size}; }
+            
+            /**
+             * @return the value and type produced by the root of the tree during the last evaluation
+             */
+            [[nodiscard]] detail::tree_eval_t result() const;
+            
+            /**
+             * @return the values produced by the root of the tree during the last batched evaluation
+             */
+            [[nodiscard]] inline detail::column_t batch_result() const
+            { return batch.stack.front(); }
+            
+            [[nodiscard]] inline tree_storage_t get_storage() const
+            { return storage; }
+            
+            // invalidates every internal cache, including the structural hashes, as the result of tree modification
             inline void invalidate()
             {
-                cache.dirty = true;
+                invalidate_layout();
+                cache.hashes.dirty = true;
             }
             
             inline blt::unsafe::any_t& data()
             {
                 return extra_data;
             }
+            
+            /**
+             * Never walks the nodes, their memory is given back when the arena is reset, or with the arena the tree owns
+             */
+            ~tree_t();
         
         private:
-            blt::bump_allocator<blt::BLT_2MB_SIZE, false> alloc;
+            // only set when the tree was not given an arena to allocate from
+            std::unique_ptr<tree_arena_t> owned_alloc;
+            tree_arena_t* alloc;
             type_engine_t& types;
+            tree_storage_t storage;
+            // used by tree_storage_t::POINTER
             detail::node_t* root = nullptr;
+            // used by tree_storage_t::FLAT
+            std::vector<detail::flat_node_t> nodes;
             // any extra data associated with this tree / individual
             blt::unsafe::any_t extra_data;
             struct cache_t
@@ -200,8 +473,38 @@ namespace fb
                 blt::size_t depth = 0;
                 blt::size_t node_count = 0;
                 detail::fitness_results fitness;
+                // post-order execution schedule used by tree_storage_t::POINTER, every node comes after all of its children
+                std::vector<detail::node_t*> execution_order;
+                // one value stack per type registered with the type engine, indexed by type_id
+                std::vector<detail::value_stack_t> values;
+                // scratch space for passing argument slots, reserved for the largest argc in the tree
+                std::vector<const blt::u8*> arguments;
+                // prefix order positions of the nodes bucketed by the type they produce, nodes[offsets[type], offsets[type + 1])
+                struct type_index_t
+                {
+                    std::vector<blt::u32> offsets;
+                    std::vector<blt::u32> nodes;
+                    bool dirty = true;
+                } type_index;
+                // merkle hashes of every subtree in prefix order, kept up to date in place by the mutation operators
+                struct hashes_t
+                {
+                    // hash of each node on its own, its function, type and constant
+                    std::vector<blt::u64> keys;
+                    std::vector<blt::u64> subtrees;
+                    std::vector<blt::u32> sizes;
+                    bool dirty = true;
+                } hashes;
                 bool dirty = true;
             } cache;
+            // scratch storage for batched evaluation, kept between calls so columns are only allocated once
+            struct batch_t
+            {
+                // backing memory of the value stack, memory[i] always holds the column at stack[i]
+                std::vector<std::vector<blt::u8>> memory;
+                std::vector<detail::column_t> stack;
+                std::vector<detail::column_t> arguments;
+            } batch;
     };
 }
 
@@ -20,21 +20,40 @@
 #define LILFBTF5_TYPE_H
 
 #include <lilfbtf/fwddecl.h>
+#include <lilfbtf/random.h>
 #include <blt/std/hashmap.h>
 #include <blt/std/memory_util.h>
 #include <vector>
+#include <atomic>
+#include <mutex>
 #include <cstdlib>
 #include <optional>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 
 namespace fb
 {
     template<typename K, typename T, bool init = false>
     class associative_array
     {
+            // without init the slots are left uninitialized until they are assigned, which is only valid for trivial types
+            static_assert(init || std::is_trivial_v<T>, "associative_array of a non-trivial type must construct its elements!");
         private:
             K size_;
             T* data_;
             
+            void destroy()
+            {
+                if constexpr (!std::is_trivially_destructible_v<T>)
+                {
+                    for (blt::size_t i = 0; i < size_; i++)
+                        data_[i].~T();
+                }
+            }
+            
             void expand()
             {
                 K new_size = static_cast<K>(size_ == 0 ? 16 : blt::mem::next_byte_allocation(size_));
@@ -46,6 +65,7 @@ namespace fb
                 }
                 for (blt::size_t i = 0; i < size_; i++)
                     new(&new_data[i]) T(std::move(data_[i]));
+                destroy();
                 std::free(data_);
                 data_ = new_data;
                 size_ = new_size;
@@ -55,6 +75,10 @@ namespace fb
             associative_array(): size_(0), data_(nullptr)
             {}
             
+            associative_array(const associative_array&) = delete;
+            
+            associative_array& operator=(const associative_array&) = delete;
+            
             [[nodiscard]] const T& at(K index) const
             {
                 while (index >= size_)
@@ -105,10 +129,231 @@ namespace fb
             
             ~associative_array()
             {
+                destroy();
                 std::free(data_);
             }
     };
     
+    namespace detail
+    {
+        /**
+         * Describes how values of a registered type are packed into a column_t, and how to move them in and out of an any_t
+         */
+        struct type_layout_t
+        {
+            blt::size_t size;
+            blt::unsafe::any_t (* load)(const blt::u8* src);
+            void (* store)(const blt::unsafe::any_t& value, blt::u8* dst);
+            
+            template<typename T>
+            static type_layout_t make()
+            {
+                static_assert(std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(blt::unsafe::any_t),
+                              "Types must fit inside of an any_t!");
+                return {sizeof(T), [](const blt::u8* src) {
+                    T value;
+                    std::memcpy(&value, src, sizeof(T));
+                    return blt::unsafe::any_t(value);
+                }, [](const blt::unsafe::any_t& value, blt::u8* dst) {
+                    T v = value.any_cast<T>();
+                    std::memcpy(dst, &v, sizeof(T));
+                }};
+            }
+        };
+        
+        /**
+         * Entry of the function dispatch table. Functions registered as plain function pointers (or stateless lambdas) are called directly,
+         * only functions registered as a func_t_call_t pay for std::function's type erasure.
+         */
+        struct dispatch_t
+        {
+            func_t_call_ptr_t ptr = nullptr;
+            const func_t_call_t* func = nullptr;
+            
+            inline void operator()(const func_t_arguments& args) const
+            {
+                if (ptr)
+                    ptr(args);
+                else
+                    (*func)(args);
+            }
+        };
+        
+        // types registered without a C++ type are kept as full any_t values
+        template<>
+        inline type_layout_t type_layout_t::make<blt::unsafe::any_t>()
+        {
+            return {sizeof(blt::unsafe::any_t), [](const blt::u8* src) {
+                blt::unsafe::any_t value;
+                std::memcpy(static_cast<void*>(&value), src, sizeof(value));
+                return value;
+            }, [](const blt::unsafe::any_t& value, blt::u8* dst) {
+                std::memcpy(dst, static_cast<const void*>(&value), sizeof(value));
+            }};
+        }
+    }
+    
+    namespace detail
+    {
+        /**
+         * Walker alias table, samples an index with probability proportional to its weight in constant time
+         */
+        class alias_table_t
+        {
+            private:
+                // chance of keeping the index that was drawn rather than taking its alias
+                std::vector<double> probability;
+                std::vector<blt::u32> alias;
+            public:
+                alias_table_t() = default;
+                
+                explicit alias_table_t(const std::vector<double>& weights);
+                
+                [[nodiscard]] inline blt::size_t sample(random_buffer_t& randoms) const
+                {
+                    auto index = randoms.random_long(0, probability.size() - 1);
+                    return randoms.choice(probability[index]) ? index : alias[index];
+                }
+                
+                [[nodiscard]] inline blt::size_t size() const
+                { return probability.size(); }
+                
+                [[nodiscard]] inline double get_probability(blt::size_t index) const
+                { return probability[index]; }
+                
+                [[nodiscard]] inline blt::u32 get_alias(blt::size_t index) const
+                { return alias[index]; }
+        };
+        
+        /**
+         * Immutable, contiguous copy of everything the tree builders and evaluators need from a type_engine_t, produced by
+         * type_engine_t::freeze(). Every per type and per function list is stored CSR style, back to back in a single array
+         * with an offset table, so lookups never probe a hashmap and the snapshot can be read from many threads without locking.
+         */
+        class type_snapshot_t
+        {
+                friend type_engine_t;
+            private:
+                // lists of functions for every type, the list of type t is functions[offsets[t]] to functions[offsets[t + 1]]
+                struct function_list_t
+                {
+                    std::vector<blt::u32> offsets{0};
+                    std::vector<function_id> functions;
+                    // alias table of every list, aliases are relative to the start of the list
+                    std::vector<double> probability;
+                    std::vector<blt::u32> alias;
+                    
+                    void append(const std::vector<function_id>& list, const std::vector<double>& weights);
+                    
+                    [[nodiscard]] inline blt::span<const function_id> at(type_id type) const
+                    { return {functions.data() + offsets[type], offsets[type + 1] - offsets[type]}; }
+                    
+                    [[nodiscard]] inline function_id select(type_id type, random_buffer_t& randoms) const
+                    {
+                        const auto begin = offsets[type];
+                        // an empty list would wrap the upper bound around and index far past the end of the list
+                        if (offsets[type + 1] == begin)
+                            throw std::logic_error("No function can be selected for type " + std::to_string(type) + ", the type cannot be closed");
+                        const auto index = begin + randoms.random_long(0, offsets[type + 1] - begin - 1);
+                        return functions[randoms.choice(probability[index]) ? index : begin + alias[index]];
+                    }
+                };
+                
+                std::vector<type_layout_t> layouts;
+                
+                std::vector<dispatch_t> functions;
+                std::vector<const func_t_batch_call_t*> batch_functions;
+                std::vector<const func_t_init_t*> initializers;
+                std::vector<type_id> outputs;
+                std::vector<blt::u32> argc;
+                std::vector<double> weights;
+                // argument types of function f are argument_types[argument_offsets[f]] to argument_types[argument_offsets[f + 1]]
+                std::vector<blt::u32> argument_offsets{0};
+                std::vector<type_id> argument_types;
+                
+                function_list_t terminal_lists;
+                function_list_t non_terminal_lists;
+                // non-terminals followed by terminals of every type
+                function_list_t function_lists;
+                function_list_t closing_lists;
+                // a single list of every non-terminal of every type
+                function_list_t any_non_terminal_list;
+            public:
+                [[nodiscard]] inline blt::size_t type_count() const
+                { return layouts.size(); }
+                
+                [[nodiscard]] inline blt::size_t function_count() const
+                { return functions.size(); }
+                
+                [[nodiscard]] inline const type_layout_t& layout(type_id type) const
+                { return layouts[type]; }
+                
+                [[nodiscard]] inline blt::u32 function_argc(function_id id) const
+                { return argc[id]; }
+                
+                [[nodiscard]] inline type_id output(function_id id) const
+                { return outputs[id]; }
+                
+                // selection weight of the function, relative to the other functions of its output type
+                [[nodiscard]] inline double weight(function_id id) const
+                { return weights[id]; }
+                
+                [[nodiscard]] inline blt::span<const type_id> arguments(function_id id) const
+                { return {argument_types.data() + argument_offsets[id], argument_offsets[id + 1] - argument_offsets[id]}; }
+                
+                // nullptr if the function has no initializer
+                [[nodiscard]] inline const func_t_init_t* initializer(function_id id) const
+                { return initializers[id]; }
+                
+                // nullptr if the function has no batched implementation
+                [[nodiscard]] inline const func_t_batch_call_t* batch_function(function_id id) const
+                { return batch_functions[id]; }
+                
+                inline void call(function_id id, const func_t_arguments& args) const
+                { functions[id](args); }
+                
+                [[nodiscard]] inline blt::span<const function_id> terminals(type_id type) const
+                { return terminal_lists.at(type); }
+                
+                [[nodiscard]] inline blt::span<const function_id> non_terminals(type_id type) const
+                { return non_terminal_lists.at(type); }
+                
+                /**
+                 * Weighted selection of a terminal producing type
+                 */
+                [[nodiscard]] inline function_id select_terminal(type_id type, random_buffer_t& randoms) const
+                { return terminal_lists.select(type, randoms); }
+                
+                /**
+                 * Weighted selection of a non-terminal producing type
+                 */
+                [[nodiscard]] inline function_id select_non_terminal(type_id type, random_buffer_t& randoms) const
+                { return non_terminal_lists.select(type, randoms); }
+                
+                /**
+                 * Weighted selection between every terminal and non-terminal producing type
+                 */
+                [[nodiscard]] inline function_id select_function(type_id type, random_buffer_t& randoms) const
+                { return function_lists.select(type, randoms); }
+                
+                /**
+                 * Weighted selection between the closing functions of the type. Recursively using only these functions
+                 * is guaranteed to close a subtree of the type within type_engine_t::get_min_closure_depth levels.
+                 */
+                [[nodiscard]] inline function_id select_closing(type_id type, random_buffer_t& randoms) const
+                { return closing_lists.select(type, randoms); }
+                
+                /**
+                 * Weighted selection between every non-terminal of every type
+                 */
+                [[nodiscard]] inline std::pair<type_id, function_id> select_any_non_terminal(random_buffer_t& randoms) const
+                {
+                    auto id = any_non_terminal_list.select(0, randoms);
+                    return {outputs[id], id};
+                }
+        };
+    }
+    
     class type_engine_t
     {
         private:
@@ -116,12 +361,16 @@ namespace fb
             blt::hashmap_t<std::string, type_id> name_to_type;
             // also used to assign IDs
             std::vector<std::string> type_to_name;
+            std::vector<detail::type_layout_t> type_layouts;
             
             blt::hashmap_t<std::string, function_id> name_to_function;
             std::vector<std::string> function_to_name;
             
-            // Also a bad idea to store references, however these functions should be declared statically so this isn't as big of an issue.
-            associative_array<function_id, std::reference_wrapper<const func_t_call_t>> functions;
+            // function id -> how to call the function. Also a bad idea to store pointers to the std::functions,
+            // however these functions should be declared statically so this isn't as big of an issue.
+            std::vector<detail::dispatch_t> functions;
+            // optional batched implementation of a function, nullptr if the function can only be called one fitness case at a time
+            associative_array<function_id, const func_t_batch_call_t*, true> batch_functions;
             // function id -> list of type_id for parameters where index 0 = arg 1
             associative_array<function_id, std::vector<type_id>, true> function_inputs;
             associative_array<function_id, type_id> function_outputs;
@@ -131,17 +380,68 @@ namespace fb
             associative_array<type_id, std::vector<function_id>, true> terminals;
             associative_array<type_id, std::vector<function_id>, true> non_terminals;
             std::vector<std::pair<type_id, function_id>> all_non_terminals;
+            
+            // selection weight of every function, defaults to 1
+            associative_array<function_id, double> function_weights;
+            
+            // type -> smallest depth of a subtree producing the type, a terminal has a depth of 1
+            associative_array<type_id, blt::size_t, true> min_closure_depth;
+            // function -> smallest depth of a subtree rooted at the function
+            associative_array<function_id, blt::size_t> function_closure_depth;
+            // type -> functions producing the type which can close a subtree in min_closure_depth, only picking these always terminates
+            associative_array<type_id, std::vector<function_id>, true> closing_functions;
+            
+            // built once and never modified afterwards, registration is rejected once the engine is frozen
+            detail::type_snapshot_t frozen_snapshot;
+            std::atomic<bool> frozen = false;
+            std::mutex freeze_mutex;
+            
+            // the caller must hold freeze_mutex
+            void build_snapshot();
+            
+            // throws std::logic_error naming what was being registered if the engine is already frozen
+            void ensure_not_frozen(const std::string& what) const;
+            
+            // computes the closure depths and closing functions of every type, run once per freeze rather than per registration
+            void rebuild_closures();
+            
+            function_id add_function(function_name func_name, type_name output, detail::dispatch_t func, arg_c_t argc, bool terminal,
+                                     std::optional<std::reference_wrapper<const func_t_init_t>> initializer);
         public:
             type_engine_t() = default;
             
-            type_id register_type(type_name type_name);
+            type_id register_type(type_name type_name, detail::type_layout_t layout = detail::type_layout_t::make<blt::unsafe::any_t>());
+            
+            /**
+             * Registers a type whose values are stored as T, allowing batched evaluation to pack columns of this type tightly.
+             */
+            template<typename T>
+            type_id register_type(type_name type_name)
+            { return register_type(type_name, detail::type_layout_t::make<T>()); }
             
             function_id register_function(function_name func_name, type_name output, const func_t_call_t& func, arg_c_t argc,
                                           std::optional<std::reference_wrapper<const func_t_init_t>> initializer = {});
             
+            function_id register_function(function_name func_name, type_name output, func_t_call_ptr_t func, arg_c_t argc,
+                                          std::optional<std::reference_wrapper<const func_t_init_t>> initializer = {});
+            
+            // stateless lambdas are stored as plain function pointers
+            template<typename FUNC, std::enable_if_t<std::is_convertible_v<FUNC, func_t_call_ptr_t>, bool> = true>
+            function_id register_function(function_name func_name, type_name output, FUNC func, arg_c_t argc,
+                                          std::optional<std::reference_wrapper<const func_t_init_t>> initializer = {})
+            { return register_function(func_name, output, static_cast<func_t_call_ptr_t>(func), argc, initializer); }
+            
             function_id register_terminal_function(function_name func_name, type_name output, const func_t_call_t& func,
                                                    std::optional<std::reference_wrapper<const func_t_init_t>> initializer = {});
             
+            function_id register_terminal_function(function_name func_name, type_name output, func_t_call_ptr_t func,
+                                                   std::optional<std::reference_wrapper<const func_t_init_t>> initializer = {});
+            
+            template<typename FUNC, std::enable_if_t<std::is_convertible_v<FUNC, func_t_call_ptr_t>, bool> = true>
+            function_id register_terminal_function(function_name func_name, type_name output, FUNC func,
+                                                   std::optional<std::reference_wrapper<const func_t_init_t>> initializer = {})
+            { return register_terminal_function(func_name, output, static_cast<func_t_call_ptr_t>(func), initializer); }
+            
             [[nodiscard]] inline type_id get_type_id(type_name name) const
             { return name_to_type.at(name); }
             
@@ -159,12 +459,84 @@ namespace fb
             
             type_engine_t& associate_input(function_name func_name, const std::vector<std::string>& types);
             
-            [[nodiscard]] inline const func_t_call_t& get_function(function_id id) const
+            /**
+             * Sets how likely the function is to be picked relative to the other functions of its output type, the default is 1.
+             * Weights only need to be positive, they do not have to add up to anything.
+             * @throws std::invalid_argument if the weight is not a positive finite number
+             * @throws std::logic_error if the engine is already frozen
+             */
+            type_engine_t& set_function_weight(function_name func_name, double weight);
+            
+            [[nodiscard]] inline double get_function_weight(function_id id) const
+            { return function_weights[id]; }
+            
+            static constexpr blt::size_t unclosable = std::numeric_limits<blt::size_t>::max();
+            
+            /**
+             * Compiles the engine into an immutable snapshot which is used by tree construction and evaluation. snapshot() freezes the
+             * engine on first use, so calling this is only needed to report registration errors before any tree is built. Once frozen
+             * every registration, including weights and batch functions, throws std::logic_error, and freezing again does nothing.
+             * @return the snapshot, valid for as long as the engine is
+             * @throws std::logic_error if a function is missing argument types or takes an argument of a type which cannot be closed,
+             * the builders would never be able to finish a tree using such a function
+             */
+            const detail::type_snapshot_t& freeze();
+            
+            [[nodiscard]] inline bool is_frozen() const
+            { return frozen.load(std::memory_order_acquire); }
+            
+            /**
+             * @return the snapshot of the engine, freezing it first if it is not already.
+             * Safe to call from many threads at once, but not while functions or types are being registered.
+             */
+            [[nodiscard]] inline const detail::type_snapshot_t& snapshot()
+            {
+                if (!frozen.load(std::memory_order_acquire))
+                    return freeze();
+                return frozen_snapshot;
+            }
+            
+            /**
+             * @return the smallest depth of any subtree producing type, or unclosable if every subtree of the type is infinite.
+             * trees can only be constructed from types which are closable. Closure depths are computed by freeze(), even one which throws,
+             * and do not reflect anything registered since.
+             */
+            [[nodiscard]] inline blt::size_t get_min_closure_depth(type_id type) const
+            { return min_closure_depth[type]; }
+            
+            /**
+             * @return the smallest depth of any subtree rooted at the function as of the last freeze(), or unclosable
+             */
+            [[nodiscard]] inline blt::size_t get_function_closure_depth(function_id id) const
+            { return function_closure_depth[id]; }
+            
+            [[nodiscard]] inline const std::vector<function_id>& get_closing_functions(type_id type) const
+            { return closing_functions[type]; }
+            
+            /**
+             * Provides an implementation of the function which is called once per column of fitness cases during batched evaluation.
+             * Functions without one are called once per fitness case instead.
+             */
+            type_engine_t& associate_batch(function_name func_name, const func_t_batch_call_t& func);
+            
+            [[nodiscard]] inline const detail::type_layout_t& get_type_layout(type_id id) const
+            { return type_layouts[id]; }
+            
+            [[nodiscard]] inline blt::size_t get_type_count() const
+            { return type_layouts.size(); }
+            
+            [[nodiscard]] inline const func_t_batch_call_t* get_batch_function(function_id id) const
+            { return batch_functions[id]; }
+            
+            [[nodiscard]] inline const detail::dispatch_t& get_function(function_id id) const
             { return functions[id]; }
             
-            [[nodiscard]] inline const func_t_call_t& get_function(function_name name) const
+            [[nodiscard]] inline const detail::dispatch_t& get_function(function_name name) const
             { return get_function(get_function_id(name)); }
             
+            inline void call(function_id id, const detail::func_t_arguments& args) const
+            { functions[id](args); }
+            
             [[nodiscard]] inline std::optional<std::reference_wrapper<const func_t_init_t>> get_function_initializer(function_id id) const
             {
                 if (!function_initializer.contains(id))
@@ -0,0 +1,121 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lilfbtf/arena.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace fb
+{
+    namespace
+    {
+        // every arena and every reset of an arena gets a new id, so a stale slab can never be mistaken for a current one
+        std::atomic<blt::u64> next_arena_id = 1;
+        
+        // the slab a thread is currently allocating from, for one arena
+        struct thread_slab_t
+        {
+            blt::u64 arena_id = 0;
+            tree_arena_t::cursor_t cursor;
+        };
+        
+        // a thread usually only works with one or two arenas at a time, such as the current and next generation
+        thread_local std::array<thread_slab_t, 4> thread_slabs{};
+        
+        inline tree_arena_t::cursor_t& find_slab(blt::u64 arena_id)
+        {
+            for (auto& slab : thread_slabs)
+            {
+                if (slab.arena_id == arena_id)
+                    return slab.cursor;
+            }
+            // evict the oldest entry, the remaining space of its slab is left unused
+            std::rotate(thread_slabs.rbegin(), thread_slabs.rbegin() + 1, thread_slabs.rend());
+            thread_slabs.front() = {arena_id, {}};
+            return thread_slabs.front().cursor;
+        }
+        
+        inline blt::u8* align_up(blt::u8* ptr, blt::size_t alignment)
+        {
+            auto address = reinterpret_cast<std::uintptr_t>(ptr);
+            return ptr + ((alignment - address % alignment) % alignment);
+        }
+    }
+    
+    tree_arena_t::tree_arena_t(blt::size_t slab_size, bool concurrent): slab_size(slab_size), concurrent(concurrent), id(next_arena_id++)
+    {}
+    
+    void* tree_arena_t::allocate(blt::size_t bytes, blt::size_t alignment)
+    {
+        auto& cursor = concurrent ? find_slab(id) : local;
+        auto* ptr = align_up(cursor.current, alignment);
+        if (cursor.current != nullptr && ptr + bytes <= cursor.end)
+        {
+            cursor.current = ptr + bytes;
+            return ptr;
+        }
+        return allocate_slow(cursor, bytes, alignment);
+    }
+    
+    void* tree_arena_t::allocate_slow(cursor_t& cursor, blt::size_t bytes, blt::size_t alignment)
+    {
+        const auto fits = [bytes, alignment](const slab_t& slab) { return align_up(slab.memory, alignment) + bytes <= slab.memory + slab.size; };
+        slab_t slab{};
+        {
+            std::scoped_lock lock(slab_mutex);
+            // slabs past next_slab were kept by reset(), reuse the first one large enough before asking for more memory
+            auto free = std::find_if(slabs.begin() + static_cast<std::ptrdiff_t>(next_slab), slabs.end(), fits);
+            if (free == slabs.end())
+            {
+                const auto size = std::max(slab_size, bytes + alignment);
+                slabs.push_back({static_cast<blt::u8*>(::operator new(size)), size});
+                free = slabs.end() - 1;
+            }
+            std::iter_swap(slabs.begin() + static_cast<std::ptrdiff_t>(next_slab), free);
+            slab = slabs[next_slab++];
+        }
+        auto* ptr = align_up(slab.memory, alignment);
+        cursor.current = ptr + bytes;
+        cursor.end = slab.memory + slab.size;
+        return ptr;
+    }
+    
+    void tree_arena_t::reset()
+    {
+        std::scoped_lock lock(slab_mutex);
+        // the slabs are kept for the next generation, only the cursors pointing into them are invalidated
+        next_slab = 0;
+        local = {};
+        id = next_arena_id++;
+    }
+    
+    blt::size_t tree_arena_t::reserved()
+    {
+        std::scoped_lock lock(slab_mutex);
+        blt::size_t total = 0;
+        for (const auto& slab : slabs)
+            total += slab.size;
+        return total;
+    }
+    
+    tree_arena_t::~tree_arena_t()
+    {
+        for (auto& slab : slabs)
+            ::operator delete(slab.memory);
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lilfbtf/fitness_cache.h>
+#include <algorithm>
+#include <iterator>
+
+namespace fb
+{
+    fitness_cache_t::fitness_cache_t(blt::size_t capacity, eviction_t policy)
+    { configure(capacity, policy); }
+    
+    void fitness_cache_t::configure(blt::size_t capacity, eviction_t eviction)
+    {
+        clear();
+        total_capacity = capacity;
+        policy = eviction;
+        active_shards = std::clamp<blt::size_t>(capacity, 1, SHARD_COUNT);
+        // the remainder is spread over the first shards, so the active shards together hold exactly capacity entries
+        for (blt::size_t i = 0; i < SHARD_COUNT; i++)
+        {
+            std::scoped_lock lock(shards[i].mutex);
+            shards[i].capacity = i < active_shards ? capacity / active_shards + (i < capacity % active_shards ? 1 : 0) : 0;
+        }
+    }
+    
+    bool fitness_cache_t::find(blt::u64 hash, detail::fitness_results& fitness, blt::span<float> errors)
+    {
+        auto& shard = shard_of(hash);
+        {
+            std::scoped_lock lock(shard.mutex);
+            auto found = shard.lookup.find(hash);
+            if (found != shard.lookup.end() && found->second->errors.size() == errors.size())
+            {
+                auto entry = found->second;
+                if (policy == eviction_t::LRU)
+                    shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+                fitness = entry->fitness;
+                std::copy(entry->errors.begin(), entry->errors.end(), errors.begin());
+                hit_count.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        miss_count.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    
+    void fitness_cache_t::insert(blt::u64 hash, const detail::fitness_results& fitness, blt::span<const float> errors)
+    {
+        auto& shard = shard_of(hash);
+        std::scoped_lock lock(shard.mutex);
+        if (shard.capacity == 0)
+            return;
+        auto found = shard.lookup.find(hash);
+        if (found != shard.lookup.end())
+        {
+            auto entry = found->second;
+            entry->fitness = fitness;
+            entry->errors.assign(errors.begin(), errors.end());
+            if (policy == eviction_t::LRU)
+                shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+            return;
+        }
+        if (shard.entries.size() >= shard.capacity)
+        {
+            // the evicted entry is reused, which keeps the allocation of its case errors
+            auto evicted = std::prev(shard.entries.end());
+            shard.lookup.erase(evicted->hash);
+            shard.entries.splice(shard.entries.begin(), shard.entries, evicted);
+            eviction_count.fetch_add(1, std::memory_order_relaxed);
+        } else
+            shard.entries.emplace_front();
+        auto& entry = shard.entries.front();
+        entry.hash = hash;
+        entry.fitness = fitness;
+        entry.errors.assign(errors.begin(), errors.end());
+        shard.lookup[hash] = shard.entries.begin();
+    }
+    
+    void fitness_cache_t::clear()
+    {
+        for (auto& shard : shards)
+        {
+            std::scoped_lock lock(shard.mutex);
+            shard.entries.clear();
+            shard.lookup.clear();
+        }
+    }
+    
+    blt::size_t fitness_cache_t::size()
+    {
+        blt::size_t total = 0;
+        for (auto& shard : shards)
+        {
+            std::scoped_lock lock(shard.mutex);
+            total += shard.entries.size();
+        }
+        return total;
+    }
+}
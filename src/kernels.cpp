@@ -0,0 +1,510 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lilfbtf/kernels.h>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define LILFBTF_X86_KERNELS
+    #include <immintrin.h>
+    #define LILFBTF_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace fb::kernels
+{
+    static_assert(sizeof(bool) == sizeof(blt::u8), "bool columns are expected to use a single byte per value");
+    
+    namespace
+    {
+        using binary_kernel_t = void (*)(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+        using select_kernel_t = void (*)(const blt::u8* cond, const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count);
+        
+        struct add_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a + b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            { return _mm_add_epi8(a, b); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            { return _mm256_add_epi8(a, b); }
+#endif
+        };
+        
+        struct sub_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a - b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            { return _mm_sub_epi8(a, b); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            { return _mm256_sub_epi8(a, b); }
+#endif
+        };
+        
+        struct mul_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a * b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            // there is no 8 bit multiply, so the even and odd bytes are multiplied as 16 bit values and the low bytes merged back together
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            {
+                auto even = _mm_mullo_epi16(a, b);
+                auto odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+                return _mm_or_si128(_mm_slli_epi16(odd, 8), _mm_and_si128(even, _mm_set1_epi16(0xFF)));
+            }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            {
+                auto even = _mm256_mullo_epi16(a, b);
+                auto odd = _mm256_mullo_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+                return _mm256_or_si256(_mm256_slli_epi16(odd, 8), _mm256_and_si256(even, _mm256_set1_epi16(0xFF)));
+            }
+#endif
+        };
+        
+        struct div_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return b == 0 ? 0 : a / b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            // there is no integer division either. every u8 is exact as a float and a quotient is never close enough to the next
+            // integer to round up, so dividing as floats and truncating gives the same result as integer division.
+            LILFBTF_TARGET("sse2") static inline __m128i div_epi32(__m128i a, __m128i b)
+            { return _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(a), _mm_cvtepi32_ps(b))); }
+            
+            LILFBTF_TARGET("sse2") static inline __m128i div_epi16(__m128i a, __m128i b)
+            {
+                auto zero = _mm_setzero_si128();
+                auto low = div_epi32(_mm_unpacklo_epi16(a, zero), _mm_unpacklo_epi16(b, zero));
+                auto high = div_epi32(_mm_unpackhi_epi16(a, zero), _mm_unpackhi_epi16(b, zero));
+                return _mm_packs_epi32(low, high);
+            }
+            
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            {
+                auto zero = _mm_setzero_si128();
+                auto low = div_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+                auto high = div_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+                return _mm_andnot_si128(_mm_cmpeq_epi8(b, zero), _mm_packus_epi16(low, high));
+            }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i div_epi32(__m256i a, __m256i b)
+            { return _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(a), _mm256_cvtepi32_ps(b))); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i div_epi16(__m256i a, __m256i b)
+            {
+                auto zero = _mm256_setzero_si256();
+                auto low = div_epi32(_mm256_unpacklo_epi16(a, zero), _mm256_unpacklo_epi16(b, zero));
+                auto high = div_epi32(_mm256_unpackhi_epi16(a, zero), _mm256_unpackhi_epi16(b, zero));
+                return _mm256_packs_epi32(low, high);
+            }
+            
+            // unpack and pack both work within 128 bit lanes, so the round trip keeps every byte in place
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            {
+                auto zero = _mm256_setzero_si256();
+                auto low = div_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+                auto high = div_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+                return _mm256_andnot_si256(_mm256_cmpeq_epi8(b, zero), _mm256_packus_epi16(low, high));
+            }
+#endif
+        };
+        
+        struct and_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a & b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            { return _mm_and_si128(a, b); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            { return _mm256_and_si256(a, b); }
+#endif
+        };
+        
+        struct or_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a | b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            { return _mm_or_si128(a, b); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            { return _mm256_or_si256(a, b); }
+#endif
+        };
+        
+        // comparisons are unsigned, a >= b exactly when max(a, b) == a. the resulting masks are reduced to 0 or 1 to form bools.
+        struct less_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a < b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            { return _mm_andnot_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, b), a), _mm_set1_epi8(1)); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            { return _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a), _mm256_set1_epi8(1)); }
+#endif
+        };
+        
+        struct greater_op
+        {
+            static inline blt::u8 scalar(blt::u8 a, blt::u8 b)
+            { return a > b; }
+
+#ifdef LILFBTF_X86_KERNELS
+            LILFBTF_TARGET("sse2") static inline __m128i sse2(__m128i a, __m128i b)
+            { return _mm_andnot_si128(_mm_cmpeq_epi8(_mm_max_epu8(a, b), b), _mm_set1_epi8(1)); }
+            
+            LILFBTF_TARGET("avx2") static inline __m256i avx2(__m256i a, __m256i b)
+            { return _mm256_andnot_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(a, b), b), _mm256_set1_epi8(1)); }
+#endif
+        };
+        
+        template<typename OP>
+        void scalar_kernel(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+        {
+            for (blt::size_t i = 0; i < count; i++)
+                out[i] = OP::scalar(a[i], b[i]);
+        }
+        
+        void scalar_select(const blt::u8* cond, const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+        {
+            for (blt::size_t i = 0; i < count; i++)
+                out[i] = cond[i] ? a[i] : b[i];
+        }
+
+#ifdef LILFBTF_X86_KERNELS
+        
+        template<typename OP>
+        LILFBTF_TARGET("sse2") void sse2_kernel(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+        {
+            blt::size_t i = 0;
+            for (; i + sizeof(__m128i) <= count; i += sizeof(__m128i))
+            {
+                auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+                auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), OP::sse2(va, vb));
+            }
+            for (; i < count; i++)
+                out[i] = OP::scalar(a[i], b[i]);
+        }
+        
+        LILFBTF_TARGET("sse2") void sse2_select(const blt::u8* cond, const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+        {
+            blt::size_t i = 0;
+            for (; i + sizeof(__m128i) <= count; i += sizeof(__m128i))
+            {
+                auto is_false = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cond + i)), _mm_setzero_si128());
+                auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+                auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_or_si128(_mm_and_si128(is_false, vb), _mm_andnot_si128(is_false, va)));
+            }
+            for (; i < count; i++)
+                out[i] = cond[i] ? a[i] : b[i];
+        }
+        
+        template<typename OP>
+        LILFBTF_TARGET("avx2") void avx2_kernel(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+        {
+            blt::size_t i = 0;
+            for (; i + sizeof(__m256i) <= count; i += sizeof(__m256i))
+            {
+                auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+                auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), OP::avx2(va, vb));
+            }
+            for (; i < count; i++)
+                out[i] = OP::scalar(a[i], b[i]);
+        }
+        
+        LILFBTF_TARGET("avx2") void avx2_select(const blt::u8* cond, const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+        {
+            blt::size_t i = 0;
+            for (; i + sizeof(__m256i) <= count; i += sizeof(__m256i))
+            {
+                auto is_false = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cond + i)), _mm256_setzero_si256());
+                auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+                auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_blendv_epi8(va, vb, is_false));
+            }
+            for (; i < count; i++)
+                out[i] = cond[i] ? a[i] : b[i];
+        }
+
+#endif
+        
+        float scalar_min(const float* values, blt::size_t count)
+        {
+            float minimum = values[0];
+            for (blt::size_t i = 1; i < count; i++)
+                minimum = std::min(minimum, values[i]);
+            return minimum;
+        }
+        
+        blt::size_t scalar_filter(const float* values, blt::size_t count, float threshold, blt::u32* out)
+        {
+            blt::size_t written = 0;
+            for (blt::size_t i = 0; i < count; i++)
+            {
+                if (values[i] <= threshold)
+                    out[written++] = static_cast<blt::u32>(i);
+            }
+            return written;
+        }
+
+#ifdef LILFBTF_X86_KERNELS
+        
+        // writes base + the index of every set bit of mask, lowest first
+        inline blt::size_t write_mask(blt::u32 mask, blt::size_t base, blt::u32* out)
+        {
+            blt::size_t written = 0;
+            while (mask != 0)
+            {
+                out[written++] = static_cast<blt::u32>(base + static_cast<blt::size_t>(__builtin_ctz(mask)));
+                mask &= mask - 1;
+            }
+            return written;
+        }
+        
+        LILFBTF_TARGET("sse2") float sse2_min(const float* values, blt::size_t count)
+        {
+            blt::size_t i = 0;
+            float minimum = values[0];
+            if (count >= 4)
+            {
+                auto vmin = _mm_loadu_ps(values);
+                for (i = 4; i + 4 <= count; i += 4)
+                    vmin = _mm_min_ps(vmin, _mm_loadu_ps(values + i));
+                vmin = _mm_min_ps(vmin, _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(1, 0, 3, 2)));
+                vmin = _mm_min_ps(vmin, _mm_shuffle_ps(vmin, vmin, _MM_SHUFFLE(2, 3, 0, 1)));
+                minimum = _mm_cvtss_f32(vmin);
+            }
+            for (; i < count; i++)
+                minimum = std::min(minimum, values[i]);
+            return minimum;
+        }
+        
+        LILFBTF_TARGET("sse2") blt::size_t sse2_filter(const float* values, blt::size_t count, float threshold, blt::u32* out)
+        {
+            blt::size_t i = 0;
+            blt::size_t written = 0;
+            const auto vthreshold = _mm_set1_ps(threshold);
+            for (; i + 4 <= count; i += 4)
+            {
+                const auto mask = static_cast<blt::u32>(_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(values + i), vthreshold)));
+                written += write_mask(mask, i, out + written);
+            }
+            for (; i < count; i++)
+            {
+                if (values[i] <= threshold)
+                    out[written++] = static_cast<blt::u32>(i);
+            }
+            return written;
+        }
+        
+        LILFBTF_TARGET("avx2") float avx2_min(const float* values, blt::size_t count)
+        {
+            if (count < 8)
+                return sse2_min(values, count);
+            blt::size_t i = 8;
+            auto vmin = _mm256_loadu_ps(values);
+            for (; i + 8 <= count; i += 8)
+                vmin = _mm256_min_ps(vmin, _mm256_loadu_ps(values + i));
+            auto half = _mm_min_ps(_mm256_castps256_ps128(vmin), _mm256_extractf128_ps(vmin, 1));
+            half = _mm_min_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(1, 0, 3, 2)));
+            half = _mm_min_ps(half, _mm_shuffle_ps(half, half, _MM_SHUFFLE(2, 3, 0, 1)));
+            float minimum = _mm_cvtss_f32(half);
+            for (; i < count; i++)
+                minimum = std::min(minimum, values[i]);
+            return minimum;
+        }
+        
+        LILFBTF_TARGET("avx2") blt::size_t avx2_filter(const float* values, blt::size_t count, float threshold, blt::u32* out)
+        {
+            blt::size_t i = 0;
+            blt::size_t written = 0;
+            const auto vthreshold = _mm256_set1_ps(threshold);
+            for (; i + 8 <= count; i += 8)
+            {
+                const auto mask = static_cast<blt::u32>(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(values + i), vthreshold, _CMP_LE_OQ)));
+                written += write_mask(mask, i, out + written);
+            }
+            for (; i < count; i++)
+            {
+                if (values[i] <= threshold)
+                    out[written++] = static_cast<blt::u32>(i);
+            }
+            return written;
+        }
+
+#endif
+        
+        struct selection_table_t
+        {
+            float (* min)(const float* values, blt::size_t count);
+            blt::size_t (* filter)(const float* values, blt::size_t count, float threshold, blt::u32* out);
+        };
+        
+        struct kernel_table_t
+        {
+            binary_kernel_t add, sub, mul, div, bit_and, bit_or, less, greater;
+            select_kernel_t select;
+        };
+        
+        simd_level_t detect_simd_level()
+        {
+#ifdef LILFBTF_X86_KERNELS
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return simd_level_t::AVX2;
+            if (__builtin_cpu_supports("sse2"))
+                return simd_level_t::SSE2;
+#endif
+            return simd_level_t::SCALAR;
+        }
+        
+        const kernel_table_t& kernel_table()
+        {
+            static const kernel_table_t table = []() -> kernel_table_t {
+                switch (simd_level())
+                {
+#ifdef LILFBTF_X86_KERNELS
+                    case simd_level_t::AVX2:
+                        return {avx2_kernel<add_op>, avx2_kernel<sub_op>, avx2_kernel<mul_op>, avx2_kernel<div_op>, avx2_kernel<and_op>,
+                                avx2_kernel<or_op>, avx2_kernel<less_op>, avx2_kernel<greater_op>, avx2_select};
+                    case simd_level_t::SSE2:
+                        return {sse2_kernel<add_op>, sse2_kernel<sub_op>, sse2_kernel<mul_op>, sse2_kernel<div_op>, sse2_kernel<and_op>,
+                                sse2_kernel<or_op>, sse2_kernel<less_op>, sse2_kernel<greater_op>, sse2_select};
+#endif
+                    default:
+                        return {scalar_kernel<add_op>, scalar_kernel<sub_op>, scalar_kernel<mul_op>, scalar_kernel<div_op>,
+                                scalar_kernel<and_op>, scalar_kernel<or_op>, scalar_kernel<less_op>, scalar_kernel<greater_op>,
+                                scalar_select};
+                }
+            }();
+            return table;
+        }
+        
+        const selection_table_t& selection_table()
+        {
+            static const selection_table_t table = []() -> selection_table_t {
+                switch (simd_level())
+                {
+#ifdef LILFBTF_X86_KERNELS
+                    case simd_level_t::AVX2:
+                        return {avx2_min, avx2_filter};
+                    case simd_level_t::SSE2:
+                        return {sse2_min, sse2_filter};
+#endif
+                    default:
+                        return {scalar_min, scalar_filter};
+                }
+            }();
+            return table;
+        }
+    }
+    
+    simd_level_t simd_level()
+    {
+        static const simd_level_t level = detect_simd_level();
+        return level;
+    }
+    
+    void add_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().add(a, b, out, count); }
+    
+    void sub_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().sub(a, b, out, count); }
+    
+    void mul_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().mul(a, b, out, count); }
+    
+    void div_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().div(a, b, out, count); }
+    
+    void and_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().bit_and(a, b, out, count); }
+    
+    void or_u8(const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().bit_or(a, b, out, count); }
+    
+    void less_u8(const blt::u8* a, const blt::u8* b, bool* out, blt::size_t count)
+    { kernel_table().less(a, b, reinterpret_cast<blt::u8*>(out), count); }
+    
+    void greater_u8(const blt::u8* a, const blt::u8* b, bool* out, blt::size_t count)
+    { kernel_table().greater(a, b, reinterpret_cast<blt::u8*>(out), count); }
+    
+    void if_u8(const bool* cond, const blt::u8* a, const blt::u8* b, blt::u8* out, blt::size_t count)
+    { kernel_table().select(reinterpret_cast<const blt::u8*>(cond), a, b, out, count); }
+    
+    float min_f32(const float* values, blt::size_t count)
+    { return selection_table().min(values, count); }
+    
+    blt::size_t filter_f32(const float* values, blt::size_t count, float threshold, blt::u32* out)
+    { return selection_table().filter(values, count, threshold, out); }
+    
+    const func_t_batch_call_t add_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        add_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t sub_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        sub_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t mul_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        mul_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t div_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        div_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t and_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        and_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t or_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        or_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t less_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        less_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.as<bool>().data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t greater_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        greater_u8(args.arguments[0].data(), args.arguments[1].data(), args.result.as<bool>().data(), args.result.size());
+    };
+    
+    const func_t_batch_call_t if_u8_batch = [](const detail::func_t_batch_arguments& args) {
+        if_u8(args.arguments[0].as<bool>().data(), args.arguments[1].data(), args.arguments[2].data(), args.result.data(), args.result.size());
+    };
+}
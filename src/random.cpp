@@ -15,48 +15,188 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <lilfbtf/random.h>
+#include <algorithm>
+#include <limits>
 
 namespace fb
 {
-    
-    random::random(blt::u64 seed): seed(seed), engine(seed)
+    namespace
     {
+        blt::u64 splitmix64(blt::u64& x)
+        {
+            blt::u64 z = (x += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+    }
     
+    random::random(blt::u64 seed, blt::u64 stream): seed(seed), stream(stream), state()
+    {
+        reset();
     }
     
     void random::reset()
     {
-        engine.seed(seed);
+        // the stream number is mixed in first, so neighbouring streams of the same seed start from unrelated states
+        blt::u64 x = seed;
+        blt::u64 s = stream;
+        x ^= splitmix64(s);
+        for (auto& v : state)
+            v = splitmix64(x);
+        for (auto& word : lane_state)
+            for (auto& v : word)
+                v = splitmix64(x);
+    }
+    
+    void random::jump()
+    {
+        static constexpr blt::u64 jump_polynomial[] = {0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c};
+        
+        // the bulk generators are jumped along with the scalar one, otherwise a split stream would fill the same values as its parent
+        blt::u64 jumped[4] = {0, 0, 0, 0};
+        blt::u64 jumped_lanes[4][lanes] = {};
+        blt::u64 discarded[lanes];
+        for (auto poly : jump_polynomial)
+        {
+            for (int b = 0; b < 64; b++)
+            {
+                if (poly & (1ull << b))
+                {
+                    for (int i = 0; i < 4; i++)
+                    {
+                        jumped[i] ^= state[i];
+                        for (blt::size_t l = 0; l < lanes; l++)
+                            jumped_lanes[i][l] ^= lane_state[i][l];
+                    }
+                }
+                next();
+                next_lanes(discarded);
+            }
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            state[i] = jumped[i];
+            for (blt::size_t l = 0; l < lanes; l++)
+                lane_state[i][l] = jumped_lanes[i][l];
+        }
+    }
+    
+    random random::split()
+    {
+        random copy = *this;
+        jump();
+        return copy;
+    }
+    
+    void random::next_lanes(blt::u64* out)
+    {
+        auto& s0 = lane_state[0];
+        auto& s1 = lane_state[1];
+        auto& s2 = lane_state[2];
+        auto& s3 = lane_state[3];
+        for (blt::size_t l = 0; l < lanes; l++)
+        {
+            out[l] = rotl(s1[l] * 5, 7) * 9;
+            const blt::u64 t = s1[l] << 17;
+            s2[l] ^= s0[l];
+            s3[l] ^= s1[l];
+            s1[l] ^= s2[l];
+            s0[l] ^= s3[l];
+            s2[l] ^= t;
+            s3[l] = rotl(s3[l], 45);
+        }
+    }
+    
+    void random::fill(blt::span<blt::u64> out)
+    {
+        blt::size_t i = 0;
+        for (; i + lanes <= out.size(); i += lanes)
+            next_lanes(&out[i]);
+        if (i < out.size())
+        {
+            blt::u64 rest[lanes];
+            next_lanes(rest);
+            for (blt::size_t l = 0; i < out.size(); i++, l++)
+                out[i] = rest[l];
+        }
+    }
+    
+    void random::fill_long(blt::span<blt::u64> out, blt::u64 min, blt::u64 max)
+    {
+        fill(out);
+        const blt::u64 bound = max - min + 1;
+        if (bound == 0)
+            return;
+        const blt::u64 threshold = -bound % bound;
+        for (auto& v : out)
+        {
+            blt::u64 low;
+            auto high = detail::mul_hi64(v, bound, low);
+            // the rare biased values are redrawn from the scalar generator
+            while (low < threshold)
+                high = detail::mul_hi64(next(), bound, low);
+            v = min + high;
+        }
+    }
+    
+    void random::fill_double(blt::span<double> out, double min, double max)
+    {
+        std::array<blt::u64, 64> raw{};
+        for (blt::size_t i = 0; i < out.size(); i += raw.size())
+        {
+            const auto count = std::min(raw.size(), out.size() - i);
+            fill({raw.data(), count});
+            for (blt::size_t j = 0; j < count; j++)
+                out[i + j] = min + static_cast<double>(raw[j] >> 11) * 0x1.0p-53 * (max - min);
+        }
     }
     
-    bool random::choice()
+    void random::fill_choice(blt::span<bool> out, double d)
     {
-        static std::uniform_int_distribution<int> dist(0, 1);
-        return dist(engine);
+        std::array<blt::u64, 64> raw{};
+        for (blt::size_t i = 0; i < out.size(); i += raw.size())
+        {
+            const auto count = std::min(raw.size(), out.size() - i);
+            fill({raw.data(), count});
+            for (blt::size_t j = 0; j < count; j++)
+                out[i + j] = static_cast<double>(raw[j] >> 11) * 0x1.0p-53 < d;
+        }
     }
     
     float random::random_float(float min, float max)
     {
-        std::uniform_real_distribution<float> dist(min, max);
-        return dist(engine);
+        // top 24 bits fill the float's mantissa exactly
+        return min + static_cast<float>(next() >> 40) * 0x1.0p-24f * (max - min);
     }
     
     double random::random_double(double min, double max)
     {
-        std::uniform_real_distribution<double> dist(min, max);\
-        return dist(engine);
+        return min + static_cast<double>(next() >> 11) * 0x1.0p-53 * (max - min);
     }
     
     blt::u64 random::random_long(blt::u64 min, blt::u64 max)
     {
-        std::uniform_int_distribution<blt::u64> dist(min, max);
-        return dist(engine);
+        const blt::u64 range = max - min;
+        if (range == std::numeric_limits<blt::u64>::max())
+            return next();
+        // lemire's multiply and shift, rejecting the few values which would bias the result
+        const blt::u64 bound = range + 1;
+        blt::u64 low;
+        auto high = detail::mul_hi64(next(), bound, low);
+        if (low < bound)
+        {
+            const blt::u64 threshold = -bound % bound;
+            while (low < threshold)
+                high = detail::mul_hi64(next(), bound, low);
+        }
+        return min + high;
     }
     
     blt::i32 random::random_int(blt::i32 min, blt::i32 max)
     {
-        std::uniform_int_distribution<blt::i32> dist(min, max);
-        return dist(engine);
+        const auto offset = random_long(0, static_cast<blt::u64>(static_cast<blt::i64>(max) - min));
+        return static_cast<blt::i32>(min + static_cast<blt::i64>(offset));
     }
     
     bool random::chance(double chance)
@@ -66,7 +206,6 @@ namespace fb
     
     bool random::choice(double d)
     {
-        std::uniform_real_distribution<double> dist(0, 1);\
-        return dist(engine) < d;
+        return random_double() < d;
     }
-}
\ No newline at end of file
+}
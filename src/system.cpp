@@ -16,82 +16,607 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <lilfbtf/system.h>
+#include <lilfbtf/kernels.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <optional>
 
 namespace fb
 {
-    std::pair<tree_t, tree_t> gp_population_t::crossover(tree_t& p1, tree_t& p2)
+    namespace
     {
-    
+        // replaces the subtree of tree rooted at point with the subtree of donor rooted at donor_point
+        std::vector<detail::flat_node_t> splice(const std::vector<detail::flat_node_t>& tree, blt::size_t point,
+                                                const std::vector<detail::flat_node_t>& donor, blt::size_t donor_point)
+        {
+            std::vector<detail::flat_node_t> result;
+            result.reserve(tree.size() - tree[point].size + donor[donor_point].size);
+            result.insert(result.end(), tree.begin(), tree.begin() + static_cast<std::ptrdiff_t>(point));
+            result.insert(result.end(), donor.begin() + static_cast<std::ptrdiff_t>(donor_point),
+                          donor.begin() + static_cast<std::ptrdiff_t>(donor_point + donor[donor_point].size));
+            result.insert(result.end(), tree.begin() + static_cast<std::ptrdiff_t>(point + tree[point].size), tree.end());
+            return result;
+        }
     }
     
-    tree_t gp_population_t::mutate(tree_t& p)
+    std::pair<tree_t, std::optional<tree_t>> gp_population_t::crossover(tree_t& p1, tree_t& p2, fb::random& random, bool second_child)
     {
+        auto* arena = &next_generation().arena;
+        const auto [point1, type] = p1.select_typed_subtree(random);
+        const auto candidates = p2.nodes_of_type(type);
+        // no node of the second parent produces the same type, so there is nothing the subtree can be exchanged with
+        if (candidates.empty())
+            return {p1.copy(arena), second_child ? std::optional<tree_t>(p2.copy(arena)) : std::nullopt};
+        const auto point2 = candidates[random.random_long(0, candidates.size() - 1)];
+        
+        const auto nodes1 = p1.prefix_nodes();
+        const auto nodes2 = p2.prefix_nodes();
+        const auto make_child = [&](tree_t& parent, const std::vector<detail::flat_node_t>& nodes, blt::size_t point,
+                                    const std::vector<detail::flat_node_t>& donor, blt::size_t donor_point) {
+            tree_t child(types, parent.storage, arena);
+            child.store_nodes(splice(nodes, point, donor, donor_point));
+            child.extra_data = parent.extra_data;
+            // the nodes of a rejected child stay in the arena until the generation is released
+            return exceeds_depth_limit(child) ? parent.copy(arena) : std::move(child);
+        };
+        auto c1 = make_child(p1, nodes1, point1, nodes2, point2);
+        if (!second_child)
+            return {std::move(c1), std::nullopt};
+        return {std::move(c1), make_child(p2, nodes2, point2, nodes1, point1)};
+    }
     
+    void gp_population_t::mutate(tree_t& p, fb::random& random)
+    {
+        bool mutated = false;
+        switch (static_cast<mutation_t>(random.random_long(0, 4)))
+        {
+            case mutation_t::SUBTREE:
+                break;
+            case mutation_t::POINT:
+                mutated = p.mutate_point(random);
+                break;
+            case mutation_t::HOIST:
+                mutated = p.mutate_hoist(random);
+                break;
+            case mutation_t::SHRINK:
+                mutated = p.mutate_shrink(random);
+                break;
+            case mutation_t::CONSTANT:
+                mutated = p.mutate_constant(random);
+                break;
+        }
+        // regenerating a subtree is always possible, so it takes over whenever the selected operator had nothing to work with
+        if (!mutated)
+            p.mutate_subtree(random, growth.min_depth, growth.max_depth, growth.terminal_chance);
     }
     
     void gp_population_t::init_pop(const population_init_t init_type, blt::size_t pop_size, blt::size_t min_depth, blt::size_t max_depth,
-                                       std::optional<type_id> starting_type, double terminal_chance)
+                                       std::optional<type_id> starting_type, double terminal_chance, tree_storage_t storage)
     {
-        for (blt::size_t i = 0; i < pop_size; i++)
-        {
+        auto& population = current_generation().population;
+        auto* arena = &current_generation().arena;
+        growth = {min_depth, max_depth, terminal_chance};
+        const auto make_individual = [&](fb::random& random) {
             switch (init_type)
             {
                 case population_init_t::GROW:
-                    population.push_back(
-                            fb::tree_t::make_tree({fb::tree_init_t::GROW, engine, types, terminal_chance}, min_depth, max_depth, starting_type));
-                    break;
+                    return fb::tree_t::make_tree({fb::tree_init_t::GROW, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                                 starting_type);
                 case population_init_t::FULL:
-                    population.push_back(
-                            fb::tree_t::make_tree({fb::tree_init_t::FULL, engine, types, terminal_chance}, min_depth, max_depth, starting_type));
-                    break;
-                case population_init_t::BRETT_GROW:
-                    population.push_back(
-                            fb::tree_t::make_tree({fb::tree_init_t::BRETT_GROW, engine, types, terminal_chance}, min_depth, max_depth,
-                                                  starting_type));
-                    break;
+                    return fb::tree_t::make_tree({fb::tree_init_t::FULL, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                                 starting_type);
                 case population_init_t::RAMPED_HALF_HALF:
-                    if (engine.choice())
-                    {
-                        population.push_back(
-                                fb::tree_t::make_tree({fb::tree_init_t::GROW, engine, types, terminal_chance}, min_depth, max_depth, starting_type));
-                    } else
+                    if (random.choice())
                     {
-                        // will select between min and max
-                        population.push_back(
-                                fb::tree_t::make_tree({fb::tree_init_t::FULL, engine, types, terminal_chance}, min_depth, max_depth, starting_type));
+                        return fb::tree_t::make_tree({fb::tree_init_t::GROW, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                                     starting_type);
                     }
-                    break;
+                    // will select between min and max
+                    return fb::tree_t::make_tree({fb::tree_init_t::FULL, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                                 starting_type);
                 case population_init_t::RAMPED_TRI_HALF:
-                    if (engine.choice(0.3))
-                    {
-                        population.push_back(
-                                fb::tree_t::make_tree({fb::tree_init_t::GROW, engine, types, terminal_chance}, min_depth, max_depth, starting_type));
-                    } else if (engine.choice(0.3))
+                    if (random.choice(0.3))
                     {
-                        population.push_back(
-                                fb::tree_t::make_tree({fb::tree_init_t::FULL, engine, types, terminal_chance}, min_depth, max_depth, starting_type));
-                    } else
+                        return fb::tree_t::make_tree({fb::tree_init_t::GROW, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                                     starting_type);
+                    } else if (random.choice(0.3))
                     {
-                        population.push_back(
-                                fb::tree_t::make_tree({fb::tree_init_t::BRETT_GROW, engine, types, terminal_chance}, min_depth, max_depth,
-                                                      starting_type));
+                        return fb::tree_t::make_tree({fb::tree_init_t::FULL, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                                     starting_type);
                     }
                     break;
+                case population_init_t::BRETT_GROW:
+                    break;
+            }
+            return fb::tree_t::make_tree({fb::tree_init_t::BRETT_GROW, random, types, terminal_chance, storage, arena}, min_depth, max_depth,
+                                         starting_type);
+        };
+        
+        // trees are built in fixed size blocks, each using its own random stream of a seed drawn from the population's engine.
+        // the streams only depend on the block, so a given seed produces the same population no matter how many threads are used.
+        static constexpr blt::size_t block_size = 64;
+        const auto seed = engine.random_long(0, std::numeric_limits<blt::u64>::max());
+        const auto blocks = (pop_size + block_size - 1) / block_size;
+        
+        std::vector<std::optional<tree_t>> individuals(pop_size);
+        parallel_for(blocks, [&](blt::size_t begin, blt::size_t end) {
+            for (blt::size_t block = begin; block < end; block++)
+            {
+                fb::random random(seed, block);
+                for (blt::size_t i = block * block_size; i < std::min((block + 1) * block_size, pop_size); i++)
+                    individuals[i].emplace(make_individual(random));
+            }
+        });
+        
+        population.reserve(population.size() + pop_size);
+        for (auto& individual : individuals)
+            population.push_back(std::move(individual.value()));
+    }
+    
+    void gp_population_t::run_on_pool(blt::size_t workers, const std::function<void(blt::size_t worker)>& func)
+    {
+        // the calling thread is the last worker, so one less job is needed
+        const blt::size_t jobs = workers - 1;
+        std::mutex mutex;
+        std::condition_variable all_exited;
+        blt::size_t exited = 0;
+        // the first exception thrown by any worker, rethrown once nothing references this stack frame anymore
+        std::exception_ptr error;
+        const auto run = [&func, &mutex, &error](blt::size_t worker) {
+            try
+            {
+                func(worker);
+            } catch (...)
+            {
+                std::scoped_lock lock(mutex);
+                if (!error)
+                    error = std::current_exception();
             }
+        };
+        for (blt::size_t i = 0; i < jobs; i++)
+        {
+            pool.add_job([&run, &mutex, &all_exited, &exited, i]() {
+                run(i);
+                // notified while holding the lock, the caller cannot return and destroy the condition variable before this is done
+                std::scoped_lock lock(mutex);
+                exited++;
+                all_exited.notify_one();
+            });
+        }
+        run(jobs);
+        // every item being done is not enough, the jobs reference our stack and must have returned before we do
+        std::unique_lock lock(mutex);
+        all_exited.wait(lock, [&exited, jobs]() { return exited == jobs; });
+        if (error)
+            std::rethrow_exception(error);
+    }
+    
+    void gp_population_t::parallel_for(blt::size_t count, const std::function<void(blt::size_t, blt::size_t)>& func)
+    {
+        // small chunks keep a few large trees from stalling one thread while the others sit idle, without contending on every item
+        const blt::size_t chunk_size = std::clamp<blt::size_t>(count / (thread_count * 16), 1, 256);
+        const blt::size_t workers = std::clamp<blt::size_t>((count + chunk_size - 1) / chunk_size, 1, thread_count);
+        std::atomic<blt::size_t> next = 0;
+        
+        run_on_pool(workers, [&](blt::size_t) {
+            while (true)
+            {
+                const auto begin = next.fetch_add(chunk_size, std::memory_order_relaxed);
+                if (begin >= count)
+                    break;
+                func(begin, std::min(begin + chunk_size, count));
+            }
+        });
+    }
+    
+    namespace
+    {
+        // range of the schedule owned by one worker, the owner takes from the front and thieves take from the back
+        struct alignas(64) work_queue_t
+        {
+            std::mutex mutex;
+            blt::size_t begin = 0;
+            blt::size_t end = 0;
+            
+            bool pop_front(blt::size_t& index)
+            {
+                std::scoped_lock lock(mutex);
+                if (begin == end)
+                    return false;
+                index = begin++;
+                return true;
+            }
+            
+            // removes the back half of the remaining range, which holds the cheapest items of this queue
+            bool steal_half(blt::size_t& stolen_begin, blt::size_t& stolen_end)
+            {
+                std::scoped_lock lock(mutex);
+                if (begin == end)
+                    return false;
+                stolen_end = end;
+                end -= (end - begin + 1) / 2;
+                stolen_begin = end;
+                return true;
+            }
+            
+            void assign(blt::size_t new_begin, blt::size_t new_end)
+            {
+                std::scoped_lock lock(mutex);
+                begin = new_begin;
+                end = new_end;
+            }
+        };
+    }
+    
+    void gp_population_t::parallel_for_by_cost(const std::vector<blt::size_t>& costs, const std::function<void(blt::size_t)>& func)
+    {
+        const blt::size_t count = costs.size();
+        const blt::size_t workers = std::clamp<blt::size_t>(count, 1, thread_count);
+        
+        std::vector<blt::size_t> order(count);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&costs](blt::size_t a, blt::size_t b) { return costs[a] > costs[b]; });
+        
+        // deal the items out round-robin, largest first, so every worker starts with a similar amount of work.
+        // each worker's items are stored contiguously and stay sorted from most to least expensive.
+        std::vector<blt::size_t> schedule(count);
+        std::vector<work_queue_t> queues(workers);
+        for (blt::size_t worker = 0, offset = 0; worker < workers; worker++)
+        {
+            queues[worker].begin = offset;
+            for (blt::size_t i = worker; i < count; i += workers)
+                schedule[offset++] = order[i];
+            queues[worker].end = offset;
         }
+        
+        run_on_pool(workers, [&](blt::size_t worker) {
+            auto& queue = queues[worker];
+            while (true)
+            {
+                blt::size_t index;
+                if (queue.pop_front(index))
+                {
+                    func(schedule[index]);
+                    continue;
+                }
+                // out of work, steal from the next worker which still has some. work never returns once every queue is empty
+                bool stole = false;
+                for (blt::size_t i = 1; i < workers && !stole; i++)
+                {
+                    blt::size_t stolen_begin, stolen_end;
+                    if (queues[(worker + i) % workers].steal_half(stolen_begin, stolen_end))
+                    {
+                        queue.assign(stolen_begin, stolen_end);
+                        stole = true;
+                    }
+                }
+                if (!stole)
+                    break;
+            }
+        });
     }
     
     void gp_population_t::execute(const individual_eval_func_t& individualEvalFunc, const fitness_eval_func_t& fitnessEvalFunc)
+    { execute(individualEvalFunc, fitnessEvalFunc, 0, nullptr); }
+    
+    void gp_population_t::execute(const individual_eval_func_t& individualEvalFunc, const fitness_eval_func_t& fitnessEvalFunc,
+                                  blt::size_t case_count, const case_error_func_t& caseErrorFunc)
     {
-        for (auto& individual : population)
+        auto& population = current_generation().population;
+        const bool cached = fitness_cache.enabled();
+        std::vector<blt::u64> hashes(deduplicate || cached ? population.size() : 0);
+        parallel_for(population.size(), [&](blt::size_t begin, blt::size_t end) {
+            for (blt::size_t i = begin; i < end; i++)
+            {
+                population[i].node_count();
+                if (!hashes.empty())
+                    hashes[i] = population[i].hash();
+            }
+        });
+        
+        // structurally identical individuals are only executed once, the rest copy the results of the first one
+        std::vector<blt::size_t> representatives(population.size());
+        std::iota(representatives.begin(), representatives.end(), 0);
+        blt::size_t duplicates = 0;
+        if (deduplicate)
         {
+            std::vector<blt::size_t> order(population.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&hashes](blt::size_t a, blt::size_t b) {
+                return hashes[a] != hashes[b] ? hashes[a] < hashes[b] : a < b;
+            });
+            for (blt::size_t i = 1; i < order.size(); i++)
+            {
+                if (hashes[order[i]] != hashes[order[i - 1]])
+                    continue;
+                representatives[order[i]] = representatives[order[i - 1]];
+                duplicates++;
+            }
+        }
+        
+        scores.resize(population.size());
+        cases.case_count = caseErrorFunc ? case_count : 0;
+        cases.rows.resize(population.size() * cases.case_count);
+        const auto errors_of = [this](blt::size_t index) {
+            return blt::span<float>{cases.rows.data() + index * cases.case_count, cases.case_count};
+        };
+        
+        // structures executed by an earlier call take their results from the cache. not a std::vector<bool>, it is written from many threads
+        std::vector<blt::u8> hit(population.size());
+        if (cached)
+        {
+            parallel_for(population.size(), [&](blt::size_t begin, blt::size_t end) {
+                for (blt::size_t i = begin; i < end; i++)
+                {
+                    if (representatives[i] != i)
+                        continue;
+                    detail::fitness_results fitness{};
+                    if (!fitness_cache.find(hashes[i], fitness, errors_of(i)))
+                        continue;
+                    population[i].cache.fitness = fitness;
+                    update_score(i);
+                    hit[i] = 1;
+                }
+            });
+        }
+        
+        // evaluation time grows with the size of the tree, so the node count is used as the cost of evaluating an individual
+        std::vector<blt::size_t> unique;
+        std::vector<blt::size_t> costs;
+        for (blt::size_t i = 0; i < population.size(); i++)
+        {
+            if (representatives[i] != i || hit[i])
+                continue;
+            unique.push_back(i);
+            costs.push_back(population[i].node_count());
+        }
+        
+        parallel_for_by_cost(costs, [&](blt::size_t index) {
+            const auto i = unique[index];
+            auto& individual = population[i];
             individualEvalFunc(individual);
-            individual.cache.fitness = fitnessEvalFunc(individual.root);
+            individual.cache.fitness = fitnessEvalFunc(individual);
+            update_score(i);
+            if (cases.case_count > 0)
+                caseErrorFunc(individual, errors_of(i));
+            if (cached)
+                fitness_cache.insert(hashes[i], individual.cache.fitness, {cases.rows.data() + i * cases.case_count, cases.case_count});
+        });
+        
+        if (duplicates == 0)
+            return;
+        parallel_for(population.size(), [&](blt::size_t begin, blt::size_t end) {
+            for (blt::size_t i = begin; i < end; i++)
+            {
+                const auto representative = representatives[i];
+                if (representative == i)
+                    continue;
+                population[i].cache.fitness = population[representative].cache.fitness;
+                update_score(i);
+                const auto row = cases.rows.begin() + static_cast<std::ptrdiff_t>(representative * cases.case_count);
+                std::copy(row, row + static_cast<std::ptrdiff_t>(cases.case_count),
+                          cases.rows.begin() + static_cast<std::ptrdiff_t>(i * cases.case_count));
+            }
+        });
+    }
+    
+    void gp_population_t::update_score(blt::size_t index)
+    {
+        auto& individual = current_generation().population[index];
+        scores.fitness[index] = individual.cache.fitness.fitness;
+        scores.hits[index] = individual.cache.fitness.hits;
+        scores.sizes[index] = static_cast<blt::u32>(individual.node_count());
+    }
+    
+    blt::size_t gp_population_t::select(fb::random& random, blt::size_t tournament_size)
+    {
+        const auto count = scores.size();
+        auto best = random.random_long(0, count - 1);
+        for (blt::size_t i = 1; i < tournament_size; i++)
+        {
+            const auto contender = random.random_long(0, count - 1);
+            // ties go to the smaller individual, which keeps bloat in check when fitness plateaus
+            if (scores.fitness[contender] > scores.fitness[best] ||
+                (scores.fitness[contender] == scores.fitness[best] && scores.sizes[contender] < scores.sizes[best]))
+                best = contender;
         }
+        return best;
     }
     
-    void gp_population_t::breed_new_pop()
+    void gp_population_t::prepare_lexicase()
     {
+        const auto pop_size = scores.size();
+        const auto case_count = cases.case_count;
+        cases.columns.resize(pop_size * case_count);
+        cases.minimum.resize(case_count);
+        cases.epsilon.resize(case_count);
+        
+        // cases are transposed in blocks, so every row is read a cache line at a time
+        static constexpr blt::size_t block_size = 16;
+        const auto blocks = (case_count + block_size - 1) / block_size;
+        parallel_for(blocks, [&](blt::size_t begin, blt::size_t end) {
+            std::vector<float> deviations(pop_size);
+            for (blt::size_t block = begin; block < end; block++)
+            {
+                const auto first = block * block_size;
+                const auto last = std::min(first + block_size, case_count);
+                for (blt::size_t i = 0; i < pop_size; i++)
+                {
+                    for (blt::size_t c = first; c < last; c++)
+                    {
+                        // NaN never compares as less than or equal, so it is treated as the worst possible error instead
+                        const auto error = cases.rows[i * case_count + c];
+                        cases.columns[c * pop_size + i] = std::isnan(error) ? std::numeric_limits<float>::infinity() : error;
+                    }
+                }
+                for (blt::size_t c = first; c < last; c++)
+                {
+                    const auto* column = &cases.columns[c * pop_size];
+                    cases.minimum[c] = kernels::min_f32(column, pop_size);
+                    
+                    const auto middle = deviations.begin() + static_cast<std::ptrdiff_t>(pop_size / 2);
+                    std::copy(column, column + pop_size, deviations.begin());
+                    std::nth_element(deviations.begin(), middle, deviations.end());
+                    const auto median = *middle;
+                    for (blt::size_t i = 0; i < pop_size; i++)
+                        deviations[i] = std::abs(column[i] - median);
+                    std::nth_element(deviations.begin(), middle, deviations.end());
+                    // infinite errors would make every candidate pass, those cases only keep the best instead
+                    cases.epsilon[c] = std::isfinite(*middle) ? *middle : 0;
+                }
+            }
+        });
+    }
+    
+    blt::size_t gp_population_t::select_lexicase(fb::random& random, bool epsilon)
+    {
+        const auto pop_size = scores.size();
+        const auto case_count = cases.case_count;
+        // reused between selections, they only depend on the population size and case count
+        thread_local std::vector<blt::u32> order;
+        thread_local std::vector<blt::u32> candidates;
+        thread_local std::vector<blt::u32> positions;
+        thread_local std::vector<float> errors;
+        order.resize(case_count);
+        candidates.resize(pop_size);
+        positions.resize(pop_size);
+        errors.resize(pop_size);
+        // reset for every selection, so the order only depends on random and selections stay reproducible
+        std::iota(order.begin(), order.end(), 0);
+        
+        blt::size_t remaining = 0;
+        for (blt::size_t step = 0; step < case_count && remaining != 1; step++)
+        {
+            // the case order is shuffled lazily, only as far as this selection gets
+            std::swap(order[step], order[random.random_long(step, case_count - 1)]);
+            const auto c = order[step];
+            const auto* column = &cases.columns[c * pop_size];
+            const auto tolerance = epsilon ? cases.epsilon[c] : 0.0f;
+            if (step == 0)
+            {
+                // every individual is still a candidate, the column can be filtered directly against the precomputed minimum
+                remaining = kernels::filter_f32(column, pop_size, cases.minimum[c] + tolerance, candidates.data());
+                continue;
+            }
+            for (blt::size_t i = 0; i < remaining; i++)
+                errors[i] = column[candidates[i]];
+            const auto threshold = kernels::min_f32(errors.data(), remaining) + tolerance;
+            const auto kept = kernels::filter_f32(errors.data(), remaining, threshold, positions.data());
+            // positions are increasing and never ahead of the index they are written to, so candidates can be compacted in place
+            for (blt::size_t i = 0; i < kept; i++)
+                candidates[i] = candidates[positions[i]];
+            remaining = kept;
+        }
+        if (remaining == 0)
+            return random.random_long(0, pop_size - 1);
+        return candidates[random.random_long(0, remaining - 1)];
+    }
+    
+    void gp_population_t::breed_new_pop(double crossover_chance, double mutation_chance, blt::size_t tournament_size, selection_t selection)
+    {
+        auto& parents = current_generation().population;
+        auto& offspring = next_generation();
+        
+        // the scores are only out of step with the population when it changed without being executed
+        const bool stale_scores = scores.size() != parents.size();
+        scores.resize(parents.size());
+        // parents are read from many threads at once, so every lazily built cache is built up front
+        parallel_for(parents.size(), [&](blt::size_t begin, blt::size_t end) {
+            for (blt::size_t i = begin; i < end; i++)
+            {
+                if (parents[i].cache.dirty)
+                    parents[i].recalculate_cache();
+                if (parents[i].cache.type_index.dirty)
+                    parents[i].recalculate_type_index();
+                if (stale_scores)
+                    update_score(i);
+            }
+        });
+        
+        const bool lexicase = selection != selection_t::TOURNAMENT && cases.case_count > 0 && !parents.empty() &&
+                              cases.rows.size() == parents.size() * cases.case_count;
+        if (lexicase)
+            prepare_lexicase();
+        const auto select_parent = [&](fb::random& random) {
+            if (lexicase)
+                return select_lexicase(random, selection == selection_t::EPSILON_LEXICASE);
+            return select(random, tournament_size);
+        };
+        
+        // offspring are bred in fixed size blocks like init_pop, each writing only to its own slots using its own random stream
+        static constexpr blt::size_t block_size = 64;
+        const auto seed = engine.random_long(0, std::numeric_limits<blt::u64>::max());
+        const auto pop_size = parents.size();
+        const auto blocks = (pop_size + block_size - 1) / block_size;
+        
+        // a crossover draw fills two slots, so it has to be drawn less often than crossover_chance for that share of the offspring
+        // to come from crossover. mutation and reproduction split the remaining draws in the ratio of their own chances
+        const auto crossover_draw = crossover_chance / (2 - crossover_chance);
+        const auto mutation_draw = crossover_chance < 1 ? mutation_chance * (1 - crossover_draw) / (1 - crossover_chance) : 0;
+        
+        std::vector<std::optional<tree_t>> children(pop_size);
+        parallel_for(blocks, [&](blt::size_t begin, blt::size_t end) {
+            for (blt::size_t block = begin; block < end; block++)
+            {
+                fb::random random(seed, block);
+                const auto last = std::min((block + 1) * block_size, pop_size);
+                for (blt::size_t i = block * block_size; i < last;)
+                {
+                    const auto operation = random.random_double();
+                    if (operation < crossover_draw)
+                    {
+                        auto& p1 = parents[select_parent(random)];
+                        auto& p2 = parents[select_parent(random)];
+                        // the last slot of a block only takes one child, the second is never built rather than spilling into the next block
+                        auto [c1, c2] = crossover(p1, p2, random, i + 1 < last);
+                        children[i++].emplace(std::move(c1));
+                        if (c2)
+                            children[i++].emplace(std::move(c2.value()));
+                        continue;
+                    }
+                    auto& parent = parents[select_parent(random)];
+                    auto child = parent.copy(&offspring.arena);
+                    if (operation < crossover_draw + mutation_draw)
+                    {
+                        mutate(child, random);
+                        if (exceeds_depth_limit(child))
+                        {
+                            children[i++].emplace(parent.copy(&offspring.arena));
+                            continue;
+                        }
+                    }
+                    children[i++].emplace(std::move(child));
+                }
+            }
+        });
+        
+        offspring.population.reserve(pop_size);
+        for (auto& child : children)
+            offspring.population.push_back(std::move(child.value()));
+        
+        current = 1 - current;
+        // the parents are released all at once, their nodes are never visited
+        release(next_generation());
+        scores.resize(0);
+        cases.rows.clear();
+    }
+    
+    void gp_population_t::release(generation_t& generation)
+    {
+        generation.population.clear();
+        generation.arena.reset();
+    }
     
+    void gp_population_t::clear()
+    {
+        release(current_generation());
+        scores.resize(0);
+        cases.rows.clear();
     }
 }
\ No newline at end of file
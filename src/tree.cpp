@@ -16,249 +16,493 @@
  */
 #include <lilfbtf/tree.h>
 #include <stack>
+#include <algorithm>
+#include <cstring>
+#include <utility>
 
 namespace fb
 {
+    namespace
+    {
+        inline blt::u64 mix(blt::u64 x)
+        {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+            return x ^ (x >> 31);
+        }
+        
+        // order dependent, so the same children in another order hash differently
+        inline blt::u64 combine(blt::u64 seed, blt::u64 value)
+        { return mix(seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2))); }
+        
+        // hashes of every subtree of prefix ordered nodes, walking backwards so every child is finished before its parent
+        void hash_subtrees(const std::vector<blt::u64>& keys, const std::vector<blt::u32>& argc, std::vector<blt::u64>& subtrees,
+                           std::vector<blt::u32>& sizes)
+        {
+            subtrees.resize(keys.size());
+            sizes.resize(keys.size());
+            // finished subtrees, the top of the stack being the first child of the next node
+            std::vector<blt::u32> stack;
+            for (blt::size_t i = keys.size(); i-- > 0;)
+            {
+                auto hash = keys[i];
+                sizes[i] = 1;
+                for (blt::size_t j = 0; j < argc[i]; j++)
+                {
+                    const auto child = stack.back();
+                    stack.pop_back();
+                    hash = combine(hash, subtrees[child]);
+                    sizes[i] += sizes[child];
+                }
+                subtrees[i] = hash;
+                stack.push_back(static_cast<blt::u32>(i));
+            }
+        }
+    }
     
-    func_t::func_t(blt::size_t argc, const func_t_call_t& func, type_id output_type, function_id function_type):
-            argc_(argc), type(output_type), function(function_type), func(func)
+    func_t::func_t(blt::size_t argc, type_id output_type, function_id function_type):
+            argc_(argc), type(output_type), function(function_type)
     {}
     
-    tree_t::tree_t(type_engine_t& types): alloc(), types(types)
+    tree_t::tree_t(type_engine_t& types, tree_storage_t storage, tree_arena_t* arena): alloc(arena), types(types), storage(storage)
     {
+        // a tree on its own only needs a handful of nodes, flat trees never allocate from the arena at all
+        if (alloc == nullptr && storage == tree_storage_t::POINTER)
+        {
+            // only this tree allocates from it, so its slab is kept in the arena rather than competing for the thread's slab cache
+            owned_alloc = std::make_unique<tree_arena_t>(4096, false);
+            alloc = owned_alloc.get();
+        }
         extra_data = nullptr;
     }
     
+    tree_t::tree_t(tree_t&& move) noexcept:
+            owned_alloc(std::move(move.owned_alloc)), alloc(move.alloc), types(move.types), storage(move.storage),
+            root(std::exchange(move.root, nullptr)), nodes(std::move(move.nodes)), extra_data(move.extra_data), cache(std::move(move.cache)),
+            batch(std::move(move.batch))
+    {}
+    
+    tree_t::~tree_t() = default;
+    
     tree_t tree_t::make_tree(detail::tree_construction_info_t tree_info,
                              blt::size_t min_depth, blt::size_t max_depth, std::optional<type_id> starting_type)
     {
-        using detail::node_t;
-        tree_t tree(tree_info.types);
+        tree_t tree(tree_info.types, tree_info.storage, tree_info.arena);
+        tree.store_nodes(generate(tree_info, min_depth, max_depth, starting_type));
+        return tree;
+    }
+    
+    std::vector<detail::flat_node_t> tree_t::generate(const detail::tree_construction_info_t& tree_info, blt::size_t min_depth,
+                                                      blt::size_t max_depth, std::optional<type_id> starting_type)
+    {
+        std::vector<detail::flat_node_t> prefix_nodes;
+        random_buffer_t randoms(tree_info.engine);
+        detail::node_construction_info_t info{prefix_nodes, randoms, tree_info};
         {
             if (starting_type)
-                tree.root = allocate_non_terminal({tree, tree_info}, starting_type.value());
+                prefix_nodes.push_back(allocate_non_terminal(info, starting_type.value()));
             else
             {
-                auto& non_terminals = tree_info.types.get_all_non_terminals();
-                auto selection = non_terminals[tree_info.engine.random_long(0, non_terminals.size() - 1)];
-                func_t func(tree_info.types.get_function_argc(selection.second), tree_info.types.get_function(selection.second), selection.first,
-                            selection.second);
-                if (const auto& func_init = tree_info.types.get_function_initializer(selection.second))
-                    func_init.value()(func);
-                tree.root = tree.alloc.template emplace<node_t>(func, tree.alloc);
+                auto selection = info.types.select_any_non_terminal(randoms);
+                prefix_nodes.push_back(make_node(info, selection.first, selection.second));
             }
         }
         
         switch (tree_info.tree_type)
         {
             case tree_init_t::GROW:
-                grow({tree, tree_info}, min_depth, max_depth);
+                grow(info, min_depth, max_depth);
                 break;
             case tree_init_t::BRETT_GROW:
-                brett_grow({tree, tree_info}, min_depth, max_depth);
+                brett_grow(info, min_depth, max_depth);
                 break;
             case tree_init_t::FULL:
-                full({tree, tree_info}, tree_info.engine.random_long(min_depth, max_depth));
+                full(info, randoms.random_long(min_depth, max_depth));
+                break;
+        }
+        
+        return prefix_nodes;
+    }
+    
+    void tree_t::store_nodes(std::vector<detail::flat_node_t>&& prefix_nodes)
+    {
+        using detail::node_t;
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+                root = link_nodes(prefix_nodes);
+                break;
+            case tree_storage_t::FLAT:
+                calculate_sizes(prefix_nodes);
+                nodes = std::move(prefix_nodes);
                 break;
         }
+        invalidate();
+    }
+    
+    detail::node_t* tree_t::link_nodes(const std::vector<detail::flat_node_t>& prefix_nodes)
+    {
+        using detail::node_t;
+        node_t* subtree_root = nullptr;
+        // parent node -> index of the next child to be linked
+        std::stack<std::pair<node_t*, blt::size_t>> parents;
+        for (const auto& n : prefix_nodes)
+        {
+            func_t func(n.argc, n.type, n.function);
+            func.setValue(n.value);
+            auto* node = alloc->template emplace<node_t>(func, *alloc);
+            if (parents.empty())
+                subtree_root = node;
+            else
+            {
+                auto& parent = parents.top();
+                parent.first->children[parent.second++] = node;
+                if (parent.second == parent.first->type.argc())
+                    parents.pop();
+            }
+            if (n.argc != 0)
+                parents.emplace(node, 0);
+        }
+        return subtree_root;
+    }
+    
+    void tree_t::calculate_sizes(std::vector<detail::flat_node_t>& prefix_nodes)
+    {
+        // children are stored after their parent, so walking backwards visits every subtree before its root
+        std::vector<blt::u32> sizes;
+        for (blt::size_t i = prefix_nodes.size(); i-- > 0;)
+        {
+            auto& n = prefix_nodes[i];
+            n.size = 1;
+            for (blt::size_t j = 0; j < n.argc; j++)
+            {
+                n.size += sizes.back();
+                sizes.pop_back();
+            }
+            sizes.push_back(n.size);
+        }
+    }
+    
+    std::vector<detail::flat_node_t> tree_t::prefix_nodes() const
+    {
+        using detail::node_t;
+        if (storage == tree_storage_t::FLAT)
+            return nodes;
         
+        std::vector<detail::flat_node_t> prefix;
+        std::stack<const node_t*> stack;
+        stack.push(root);
+        while (!stack.empty())
+        {
+            const auto* node = stack.top();
+            stack.pop();
+            const auto& func = node->type;
+            prefix.push_back({func.getFunction(), func.getType(), static_cast<blt::u32>(func.argc()), 1, func.getValue()});
+            // pushed backwards so the first child is visited next
+            for (blt::size_t i = func.argc(); i-- > 0;)
+                stack.push(node->children[i]);
+        }
+        calculate_sizes(prefix);
+        return prefix;
+    }
+    
+    tree_t tree_t::copy(tree_arena_t* arena) const
+    {
+        tree_t tree(types, storage, arena);
+        tree.store_nodes(prefix_nodes());
+        tree.extra_data = extra_data;
+        // the copy is structurally identical, so the hashes can be reused rather than computed again
+        tree.cache.hashes = cache.hashes;
         return tree;
     }
     
     detail::tree_eval_t tree_t::evaluate(blt::unsafe::buffer_any_t extra_args, const fitness_eval_func_t& fitnessEvalFunc)
     {
-        using detail::node_t;
-        std::stack<node_t*> nodes;
-        std::stack<node_t*> node_stack;
+        // the execution order is only rebuilt after the tree has been modified
+        if (cache.dirty)
+            recalculate_cache();
+        
+        for (auto& stack : cache.values)
+            stack.size = 0;
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+                evaluate_pointer(extra_args);
+                break;
+            case tree_storage_t::FLAT:
+                evaluate_flat(extra_args);
+                break;
+        }
         
-        nodes.push(root);
+        cache.fitness = fitnessEvalFunc(*this);
         
-        // create the correct ordering for the node evaluation
-        while (!nodes.empty())
-        {
-            auto* top = nodes.top();
-            node_stack.push(top);
-            nodes.pop();
-            for (blt::size_t i = 0; i < top->type.argc(); i++)
-                nodes.push(top->children[i]);
+        return result();
+    }
+    
+    void tree_t::evaluate_pointer(blt::unsafe::buffer_any_t extra_args)
+    {
+        // the post-order schedule leaves the arguments of a node on the value stacks in argument order
+        for (auto* node : cache.execution_order)
+            evaluate_node(node->type, extra_args, false);
+    }
+    
+    void tree_t::evaluate_flat(blt::unsafe::buffer_any_t extra_args)
+    {
+        // every child is stored after its parent, so walking backwards always has the arguments ready, in reverse
+        for (blt::size_t i = nodes.size(); i-- > 0;)
+        {
+            const auto& node = nodes[i];
+            func_t func(node.argc, node.type, node.function);
+            func.setValue(node.value);
+            evaluate_node(func, extra_args, true);
         }
+    }
+    
+    void tree_t::evaluate_node(func_t& func, blt::unsafe::buffer_any_t extra_args, bool reversed_arguments)
+    {
+        const auto& snapshot = types.snapshot();
+        const auto argc = func.argc();
+        auto& output = cache.values[func.getType()];
+        // the result is written above every argument so that it never aliases one. reserved first, pointers into the stacks stay valid
+        output.reserve_next();
+        const auto result_index = output.size;
         
-        while (!node_stack.empty())
+        const auto argument_types = snapshot.arguments(func.getFunction());
+        auto& arguments = cache.arguments;
+        arguments.resize(argc);
+        // pop the arguments, most recently pushed first. popped values are left untouched until the result is moved down
+        for (blt::size_t i = 0; i < argc; i++)
         {
-            node_stack.top()->evaluate(extra_args);
-            node_stack.pop();
+            const auto index = reversed_arguments ? i : argc - 1 - i;
+            auto& stack = cache.values[argument_types[index]];
+            arguments[index] = stack.at(--stack.size);
         }
         
-        cache.fitness = fitnessEvalFunc(root);
+        auto* result = output.at(result_index);
+        if (argc == 0)
+            snapshot.layout(func.getType()).store(func.getValue(), result);
+        func.call(snapshot, blt::span<const blt::u8* const>{arguments.data(), arguments.size()}, result, extra_args);
         
-        return {root->type.getValue(), root->type.getType()};
+        if (output.size != result_index)
+            std::memmove(output.at(output.size), result, output.stride);
+        output.size++;
     }
     
-    detail::node_t* tree_t::allocate_non_terminal(detail::node_construction_info_t info, type_id type)
+    detail::column_t tree_t::evaluate_batch(blt::span<const blt::unsafe::buffer_any_t> fitness_cases, const fitness_eval_func_t& fitnessEvalFunc)
     {
-        const auto& non_terminals = info.types.get_non_terminals(type);
-        function_id selection = non_terminals[info.engine.random_long(0, non_terminals.size() - 1)];
-        func_t func(info.types.get_function_argc(selection), info.types.get_function(selection), type, selection);
-        if (const auto& func_init = info.types.get_function_initializer(selection))
-            func_init.value()(func);
-        return info.tree.alloc.template emplace<detail::node_t>(func, info.tree.alloc);
+        if (cache.dirty)
+            recalculate_cache();
+        
+        batch.stack.clear();
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+                // the post-order schedule leaves the arguments of a node on the stack in argument order
+                for (auto* node : cache.execution_order)
+                    evaluate_batch_node(node->type, fitness_cases, false);
+                break;
+            case tree_storage_t::FLAT:
+                // walking the prefix array backwards finishes the last argument first, leaving them on the stack in reverse
+                for (blt::size_t i = nodes.size(); i-- > 0;)
+                {
+                    auto& node = nodes[i];
+                    func_t func(node.argc, node.type, node.function);
+                    func.setValue(node.value);
+                    evaluate_batch_node(func, fitness_cases, true);
+                }
+                break;
+        }
+        
+        cache.fitness = fitnessEvalFunc(*this);
+        
+        return batch_result();
     }
     
-    detail::node_t* tree_t::allocate_terminal(detail::node_construction_info_t info, type_id type)
+    void tree_t::evaluate_batch_node(func_t& func, blt::span<const blt::unsafe::buffer_any_t> fitness_cases, bool reversed_arguments)
     {
-        const auto& terminals = info.types.get_terminals(type);
+        const auto& snapshot = types.snapshot();
+        const auto argc = func.argc();
+        const auto& layout = snapshot.layout(func.getType());
+        const auto height = batch.stack.size() - argc;
+        
+        batch.arguments.clear();
+        for (blt::size_t i = 0; i < argc; i++)
+            batch.arguments.push_back(reversed_arguments ? batch.stack[batch.stack.size() - 1 - i] : batch.stack[height + i]);
+        
+        // the output is written into the first unused column so that it can never alias one of the arguments
+        const auto free_column = batch.stack.size();
+        if (batch.memory.size() <= free_column)
+            batch.memory.resize(free_column + 1);
+        auto& memory = batch.memory[free_column];
+        if (memory.size() < fitness_cases.size() * layout.size)
+            memory.resize(fitness_cases.size() * layout.size);
+        detail::column_t result{memory.data(), fitness_cases.size(), layout.size, func.getType()};
+        
+        blt::span<const detail::column_t> arguments{batch.arguments.data(), batch.arguments.size()};
+        if (const auto* batch_func = snapshot.batch_function(func.getFunction()))
+            (*batch_func)({func, arguments, result, fitness_cases});
+        else
+        {
+            // no batched implementation, fall back to calling the function once per fitness case. columns are typed slots as well
+            auto& slots = cache.arguments;
+            slots.resize(argc);
+            for (blt::size_t i = 0; i < fitness_cases.size(); i++)
+            {
+                for (blt::size_t j = 0; j < argc; j++)
+                    slots[j] = arguments[j].at(i);
+                if (argc == 0)
+                    layout.store(func.getValue(), result.at(i));
+                func.call(snapshot, blt::span<const blt::u8* const>{slots.data(), slots.size()}, result.at(i), fitness_cases[i]);
+            }
+        }
+        
+        // pop the arguments and move the result down to where they started
+        batch.stack.resize(height);
+        std::swap(batch.memory[height], batch.memory[free_column]);
+        batch.stack.push_back(result);
+    }
+    
+    detail::tree_eval_t tree_t::result() const
+    {
+        const auto type = storage == tree_storage_t::FLAT ? nodes.front().type : root->type.getType();
+        // the root is the only value left on the stacks after an evaluation
+        return {types.snapshot().layout(type).load(cache.values[type].at(0)), type};
+    }
+    
+    detail::flat_node_t tree_t::make_node(detail::node_construction_info_t info, type_id type, function_id function)
+    {
+        auto argc = info.types.function_argc(function);
+        func_t func(argc, type, function);
+        if (const auto* func_init = info.types.initializer(function))
+            (*func_init)(func, info.engine);
+        return {function, type, static_cast<blt::u32>(argc), 1, func.getValue()};
+    }
+    
+    detail::flat_node_t tree_t::allocate_non_terminal(detail::node_construction_info_t info, type_id type)
+    {
+        // types without non-terminals can only ever be continued by a terminal
+        if (info.types.non_terminals(type).empty())
+            return allocate_terminal(info, type);
+        return make_node(info, type, info.types.select_non_terminal(type, info.randoms));
+    }
+    
+    detail::flat_node_t tree_t::allocate_terminal(detail::node_construction_info_t info, type_id type)
+    {
+        const auto terminals = info.types.terminals(type);
         
         // if we cannot allocate a terminal, we need to allocate a non-terminal in hopes of finding a closing path
         // for example bools might not have an ending terminal, it doesn't make sense to.
         if (terminals.empty())
             return allocate_non_terminal_restricted(info, type);
         
-        function_id selection = terminals[info.engine.random_long(0, terminals.size() - 1)];
-        func_t func(info.types.get_function_argc(selection), info.types.get_function(selection), type, selection);
-        if (const auto& func_init = info.types.get_function_initializer(selection))
-            func_init.value()(func);
-        return info.tree.alloc.template emplace<detail::node_t>(func, info.tree.alloc);
+        return make_node(info, type, info.types.select_terminal(type, info.randoms));
     }
     
-    detail::node_t* tree_t::allocate_non_terminal_restricted(detail::node_construction_info_t info, type_id type)
+    detail::flat_node_t tree_t::allocate_non_terminal_restricted(detail::node_construction_info_t info, type_id type)
     {
-        function_id selection = 0;
-        do
+        // only functions on a shortest path to a terminal are used, so the subtree is closed within the type's minimum closure depth
+        return make_node(info, type, info.types.select_closing(type, info.randoms));
+    }
+    
+    namespace detail
+    {
+        // an argument of an already generated node which still needs a subtree
+        struct node_slot_t
         {
-            const auto& non_terminals = info.types.get_non_terminals(type);
-            selection = info.engine.random_long(0, non_terminals.size() - 1);
-            auto& sel_v = info.types.get_function_allowed_arguments(selection);
-            // if it does not accept the type we are, we will accept this as a valid "temp" non-terminal
-            if (std::find(sel_v.begin(), sel_v.end(), type) == sel_v.end())
-                break;
-        } while (true);
+            type_id type;
+            // depth of the node owning this argument
+            blt::size_t depth;
+            // the first argument of a node below the minimum depth has to continue the tree
+            bool needs_non_terminal;
+        };
         
-        func_t func(info.types.get_function_argc(selection), info.types.get_function(selection), type, selection);
-        if (const auto& func_init = info.types.get_function_initializer(selection))
-            (*func_init)(func);
-        return info.tree.alloc.template emplace<detail::node_t>(func, info.tree.alloc);
+        // pushes the arguments of the last generated node so that they are popped, and therefore generated, in prefix order
+        inline void push_arguments(std::stack<node_slot_t>& stack, const type_snapshot_t& types, const flat_node_t& node, blt::size_t depth,
+                                   blt::size_t min_depth)
+        {
+            const auto allowed_types = types.arguments(node.function);
+            for (blt::size_t i = node.argc; i-- > 0;)
+                stack.push({allowed_types[i], depth, i == 0 && depth < min_depth});
+        }
     }
     
     void tree_t::brett_grow(detail::node_construction_info_t info, blt::size_t min_depth, blt::size_t max_depth)
     {
         using namespace detail;
-        std::stack<std::pair<node_t*, blt::size_t>> stack;
-        stack.emplace(info.tree.root, 0);
+        std::stack<node_slot_t> stack;
+        push_arguments(stack, info.types, info.nodes.front(), 0, min_depth);
         while (!stack.empty())
         {
-            auto top = stack.top();
-            auto* node = top.first;
-            auto depth = top.second;
+            auto slot = stack.top();
             stack.pop();
             
-            const auto& allowed_types = info.types.get_function_allowed_arguments(node->type.getFunction());
-            // we need to make sure there is at least one non-terminal generation, until we hit the min height
-            bool has_one_non_terminal = false;
-            for (blt::size_t i = 0; i < node->type.argc(); i++)
+            if (slot.needs_non_terminal)
             {
-                type_id type_category = allowed_types[i];
-                
-                if (depth < min_depth && !has_one_non_terminal)
-                {
-                    // make sure we have at least min height possible by using at least one non terminal
-                    node->children[i] = allocate_non_terminal(info, type_category);
-                    has_one_non_terminal = true;
-                } else if (depth >= max_depth || info.engine.choice(info.terminal_chance))
-                {
-                    // if we are above the max_height select only terminals or otherwise select between use of terminals
-                    node->children[i] = allocate_terminal(info, type_category);
-                } else
-                {
-                    // and use of non-terminals method
-                    node->children[i] = allocate_non_terminal(info, type_category);
-                }
-                // node has children that need populated
-                if (node->children[i]->type.argc() != 0)
-                    stack.emplace(node->children[i], depth + 1);
+                // make sure we have at least min height possible by using at least one non terminal
+                info.nodes.push_back(allocate_non_terminal(info, slot.type));
+            } else if (slot.depth >= max_depth || info.randoms.choice(info.terminal_chance))
+            {
+                // if we are above the max_height select only terminals or otherwise select between use of terminals
+                info.nodes.push_back(allocate_terminal(info, slot.type));
+            } else
+            {
+                // and use of non-terminals method
+                info.nodes.push_back(allocate_non_terminal(info, slot.type));
             }
+            // node has children that need populated
+            push_arguments(stack, info.types, info.nodes.back(), slot.depth + 1, min_depth);
         }
     }
     
     void tree_t::full(detail::node_construction_info_t info, blt::size_t select_depth)
     {
         using namespace detail;
-        std::stack<std::pair<node_t*, blt::size_t>> stack;
-        stack.emplace(info.tree.root, 0);
+        std::stack<node_slot_t> stack;
+        push_arguments(stack, info.types, info.nodes.front(), 0, 0);
         while (!stack.empty())
         {
-            auto top = stack.top();
-            auto* node = top.first;
-            auto depth = top.second;
+            auto slot = stack.top();
             stack.pop();
             
-            const auto& allowed_types = info.types.get_function_allowed_arguments(node->type.getFunction());
-            for (blt::size_t i = 0; i < node->type.argc(); i++)
+            if (slot.depth >= select_depth)
             {
-                type_id type_category = allowed_types[i];
-                
-                if (depth >= select_depth)
-                {
-                    // if we are above the max_height select only terminals
-                    node->children[i] = allocate_terminal(info, type_category);
-                } else
-                {
-                    // otherwise only non-terminals can be used
-                    node->children[i] = allocate_non_terminal(info, type_category);
-                }
-                // node has children that need populated
-                if (node->children[i]->type.argc() != 0)
-                    stack.emplace(node->children[i], depth + 1);
+                // if we are above the max_height select only terminals
+                info.nodes.push_back(allocate_terminal(info, slot.type));
+            } else
+            {
+                // otherwise only non-terminals can be used
+                info.nodes.push_back(allocate_non_terminal(info, slot.type));
             }
+            // node has children that need populated
+            push_arguments(stack, info.types, info.nodes.back(), slot.depth + 1, 0);
         }
     }
     
     void tree_t::grow(detail::node_construction_info_t info, blt::size_t min_depth, blt::size_t max_depth)
     {
         using namespace detail;
-        std::stack<std::pair<node_t*, blt::size_t>> stack;
-        stack.emplace(info.tree.root, 0);
+        std::stack<node_slot_t> stack;
+        push_arguments(stack, info.types, info.nodes.front(), 0, min_depth);
         while (!stack.empty())
         {
-            auto top = stack.top();
-            auto* node = top.first;
-            auto depth = top.second;
+            auto slot = stack.top();
             stack.pop();
             
-            const auto& allowed_types = info.types.get_function_allowed_arguments(node->type.getFunction());
-            // we need to make sure there is at least one non-terminal generation, until we hit the min height
-            bool has_one_non_terminal = false;
-            for (blt::size_t i = 0; i < node->type.argc(); i++)
+            if (slot.needs_non_terminal)
             {
-                type_id type_category = allowed_types[i];
-                
-                if (depth < min_depth && !has_one_non_terminal)
-                {
-                    // make sure we have at least min depth possible by using at least one non terminal
-                    node->children[i] = allocate_non_terminal(info, type_category);
-                    has_one_non_terminal = true;
-                } else if (depth >= max_depth)
-                {
-                    // if we are above the max_height select only terminals
-                    node->children[i] = allocate_terminal(info, type_category);
-                } else
-                {
-                    const auto& non_terminals = info.types.get_non_terminals(type_category);
-                    const auto& terminals = info.types.get_terminals(type_category);
-                    auto index = info.engine.random_long(0, terminals.size() + non_terminals.size());
-                    function_id selection;
-                    if (index >= non_terminals.size())
-                        selection = terminals[index - non_terminals.size()];
-                    else
-                        selection = non_terminals[index];
-                    func_t func(info.types.get_function_argc(selection), info.types.get_function(selection), type_category, selection);
-                    if (const auto& func_init = info.types.get_function_initializer(selection))
-                        func_init.value()(func);
-                    node->children[i] = info.tree.alloc.template emplace<detail::node_t>(func, info.tree.alloc);
-                }
-                // node has children that need populated
-                if (node->children[i]->type.argc() != 0)
-                    stack.emplace(node->children[i], depth + 1);
+                // make sure we have at least min depth possible by using at least one non terminal
+                info.nodes.push_back(allocate_non_terminal(info, slot.type));
+            } else if (slot.depth >= max_depth)
+            {
+                // if we are above the max_height select only terminals
+                info.nodes.push_back(allocate_terminal(info, slot.type));
+            } else
+            {
+                // weighted selection between every terminal and non-terminal of the type
+                info.nodes.push_back(make_node(info, slot.type, info.types.select_function(slot.type, info.randoms)));
             }
+            // node has children that need populated
+            push_arguments(stack, info.types, info.nodes.back(), slot.depth + 1, min_depth);
         }
     }
     
@@ -269,30 +513,436 @@ namespace fb
         return cache.depth;
     }
     
+    blt::size_t tree_t::node_count()
+    {
+        if (cache.dirty)
+            recalculate_cache();
+        return cache.node_count;
+    }
+    
+    blt::size_t tree_t::select_subtree(random& engine)
+    {
+        return engine.random_long(0, node_count() - 1);
+    }
+    
+    detail::node_t** tree_t::find_node(blt::size_t index)
+    {
+        using detail::node_t;
+        // walks the nodes in prefix order until reaching index
+        std::stack<node_t**> stack;
+        stack.push(&root);
+        for (blt::size_t position = 0;; position++)
+        {
+            auto** slot = stack.top();
+            stack.pop();
+            if (position == index)
+                return slot;
+            for (blt::size_t i = (*slot)->type.argc(); i-- > 0;)
+                stack.push(&(*slot)->children[i]);
+        }
+    }
+    
+    func_t tree_t::node_at(blt::size_t index)
+    {
+        if (storage == tree_storage_t::POINTER)
+            return (*find_node(index))->type;
+        const auto& node = nodes[index];
+        func_t func(node.argc, node.type, node.function);
+        func.setValue(node.value);
+        return func;
+    }
+    
+    void tree_t::set_node(blt::size_t index, const func_t& func)
+    {
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+                (*find_node(index))->type = func;
+                break;
+            case tree_storage_t::FLAT:
+                nodes[index].function = func.getFunction();
+                nodes[index].value = func.getValue();
+                break;
+        }
+        invalidate_layout();
+        if (!cache.hashes.dirty)
+        {
+            const auto size = cache.hashes.sizes[index];
+            cache.hashes.keys[index] = node_hash(func);
+            cache.hashes.subtrees[index] = combine_subtree(index);
+            rehash_ancestors(index, size, size);
+        }
+    }
+    
+    void tree_t::replace_subtree(blt::size_t index, std::vector<detail::flat_node_t>&& subtree)
+    {
+        calculate_sizes(subtree);
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+            {
+                // the replaced nodes stay in the arena until it is reset
+                *find_node(index) = link_nodes(subtree);
+                break;
+            }
+            case tree_storage_t::FLAT:
+            {
+                const auto old_size = nodes[index].size;
+                const auto new_size = static_cast<blt::u32>(subtree.size());
+                // the ancestors of the replaced node are exactly the earlier nodes whose subtree still covers it
+                for (blt::size_t i = 0; i < index; i++)
+                {
+                    if (i + nodes[i].size > index)
+                        nodes[i].size = nodes[i].size - old_size + new_size;
+                }
+                // overwrite the nodes both subtrees have in common, then only shift the rest of the tree by the difference
+                const auto begin = nodes.begin() + static_cast<std::ptrdiff_t>(index);
+                const auto shared = static_cast<std::ptrdiff_t>(std::min(old_size, new_size));
+                std::copy(subtree.begin(), subtree.begin() + shared, begin);
+                if (new_size < old_size)
+                    nodes.erase(begin + shared, begin + old_size);
+                else
+                    nodes.insert(begin + shared, subtree.begin() + shared, subtree.end());
+                break;
+            }
+        }
+        invalidate_layout();
+        if (!cache.hashes.dirty)
+        {
+            auto& hashes = cache.hashes;
+            std::vector<blt::u64> keys;
+            std::vector<blt::u32> argc;
+            for (const auto& n : subtree)
+            {
+                func_t func(n.argc, n.type, n.function);
+                func.setValue(n.value);
+                keys.push_back(node_hash(func));
+                argc.push_back(n.argc);
+            }
+            std::vector<blt::u64> subtrees;
+            std::vector<blt::u32> sizes;
+            hash_subtrees(keys, argc, subtrees, sizes);
+            
+            const auto old_size = hashes.sizes[index];
+            const auto new_size = static_cast<blt::u32>(subtree.size());
+            const auto splice = [index, old_size](auto& into, const auto& from) {
+                const auto begin = into.begin() + static_cast<std::ptrdiff_t>(index);
+                into.erase(begin, begin + old_size);
+                into.insert(into.begin() + static_cast<std::ptrdiff_t>(index), from.begin(), from.end());
+            };
+            splice(hashes.keys, keys);
+            splice(hashes.subtrees, subtrees);
+            splice(hashes.sizes, sizes);
+            rehash_ancestors(index, old_size, new_size);
+        }
+    }
+    
+    bool tree_t::mutate_subtree(random& engine, blt::size_t min_depth, blt::size_t max_depth, double terminal_chance)
+    {
+        const auto& snapshot = types.snapshot();
+        const auto [index, type] = select_typed_subtree(engine);
+        // the new subtree produces the same type as the one it replaces, so it is a valid argument wherever the old one was.
+        // its root is picked like any other grown slot, so the replacement is a single terminal with probability terminal_chance
+        if (!snapshot.terminals(type).empty() && engine.choice(terminal_chance))
+        {
+            std::vector<detail::flat_node_t> terminal;
+            random_buffer_t randoms(engine);
+            detail::tree_construction_info_t tree_info{tree_init_t::GROW, engine, types};
+            detail::node_construction_info_t info{terminal, randoms, tree_info};
+            terminal.push_back(make_node(info, type, snapshot.select_terminal(type, randoms)));
+            replace_subtree(index, std::move(terminal));
+        } else
+            replace_subtree(index, generate({tree_init_t::GROW, engine, types, terminal_chance, storage, alloc}, min_depth, max_depth, type));
+        return true;
+    }
+    
+    bool tree_t::mutate_point(random& engine)
+    {
+        const auto& snapshot = types.snapshot();
+        const auto index = select_subtree(engine);
+        const auto func = node_at(index);
+        const auto arguments = snapshot.arguments(func.getFunction());
+        const auto candidates = func.argc() == 0 ? snapshot.terminals(func.getType()) : snapshot.non_terminals(func.getType());
+        
+        // weighted reservoir sampling over every other function taking the same arguments, so the children stay valid.
+        // keeping each candidate with its share of the weight seen so far picks it in proportion to its function weight
+        std::optional<function_id> replacement;
+        double seen = 0;
+        for (auto candidate : candidates)
+        {
+            const auto candidate_arguments = snapshot.arguments(candidate);
+            if (candidate == func.getFunction() ||
+                !std::equal(candidate_arguments.begin(), candidate_arguments.end(), arguments.begin(), arguments.end()))
+                continue;
+            const auto weight = snapshot.weight(candidate);
+            seen += weight;
+            if (engine.random_double(0, seen) < weight)
+                replacement = candidate;
+        }
+        if (!replacement)
+            return false;
+        
+        func_t mutated(func.argc(), func.getType(), replacement.value());
+        if (const auto* func_init = snapshot.initializer(replacement.value()))
+            (*func_init)(mutated, engine);
+        set_node(index, mutated);
+        return true;
+    }
+    
+    bool tree_t::mutate_hoist(random& engine)
+    {
+        const auto candidates = nodes_of_type(node_at(0).getType());
+        // the root is always the first candidate, hoisting it would not change anything
+        if (candidates.size() < 2)
+            return false;
+        const auto index = candidates[engine.random_long(1, candidates.size() - 1)];
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+            {
+                root = *find_node(index);
+                break;
+            }
+            case tree_storage_t::FLAT:
+            {
+                const auto size = nodes[index].size;
+                nodes.erase(nodes.begin() + static_cast<std::ptrdiff_t>(index + size), nodes.end());
+                nodes.erase(nodes.begin(), nodes.begin() + static_cast<std::ptrdiff_t>(index));
+                break;
+            }
+        }
+        invalidate_layout();
+        if (!cache.hashes.dirty)
+        {
+            // the hoisted subtree keeps every hash it had, only the nodes around it are dropped
+            auto& hashes = cache.hashes;
+            const auto size = hashes.sizes[index];
+            const auto keep = [index, size](auto& values) {
+                values.erase(values.begin() + static_cast<std::ptrdiff_t>(index + size), values.end());
+                values.erase(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(index));
+            };
+            keep(hashes.keys);
+            keep(hashes.subtrees);
+            keep(hashes.sizes);
+        }
+        return true;
+    }
+    
+    bool tree_t::mutate_shrink(random& engine)
+    {
+        const auto& snapshot = types.snapshot();
+        // reservoir sampling over the non-terminals whose type has a terminal to replace them with
+        std::optional<std::pair<blt::size_t, type_id>> selected;
+        blt::size_t seen = 0;
+        for_each_node([&](blt::size_t index, const func_t& func) {
+            if (func.argc() == 0 || snapshot.terminals(func.getType()).empty())
+                return;
+            if (engine.random_long(0, seen++) == 0)
+                selected = {index, func.getType()};
+        });
+        if (!selected)
+            return false;
+        
+        std::vector<detail::flat_node_t> terminal;
+        random_buffer_t randoms(engine);
+        detail::tree_construction_info_t tree_info{tree_init_t::GROW, engine, types};
+        detail::node_construction_info_t info{terminal, randoms, tree_info};
+        terminal.push_back(make_node(info, selected->second, snapshot.select_terminal(selected->second, randoms)));
+        replace_subtree(selected->first, std::move(terminal));
+        return true;
+    }
+    
+    bool tree_t::mutate_constant(random& engine)
+    {
+        const auto& snapshot = types.snapshot();
+        // reservoir sampling over every node holding a constant
+        std::optional<std::pair<blt::size_t, func_t>> selected;
+        blt::size_t seen = 0;
+        for_each_node([&](blt::size_t index, const func_t& func) {
+            if (snapshot.initializer(func.getFunction()) == nullptr)
+                return;
+            if (engine.random_long(0, seen++) == 0)
+                selected = {index, func};
+        });
+        if (!selected)
+            return false;
+        
+        auto& func = selected->second;
+        (*snapshot.initializer(func.getFunction()))(func, engine);
+        set_node(selected->first, func);
+        return true;
+    }
+    
+    blt::u64 tree_t::hash()
+    {
+        if (cache.hashes.dirty)
+            recalculate_hashes();
+        return cache.hashes.subtrees.front();
+    }
+    
+    void tree_t::recalculate_hashes()
+    {
+        auto& hashes = cache.hashes;
+        std::vector<blt::u32> argc;
+        hashes.keys.clear();
+        for_each_node([&](blt::size_t, const func_t& func) {
+            hashes.keys.push_back(node_hash(func));
+            argc.push_back(static_cast<blt::u32>(func.argc()));
+        });
+        hash_subtrees(hashes.keys, argc, hashes.subtrees, hashes.sizes);
+        hashes.dirty = false;
+    }
+    
+    blt::u64 tree_t::node_hash(const func_t& func) const
+    {
+        const auto& snapshot = types.snapshot();
+        auto hash = combine(mix(func.getFunction()), func.getType());
+        // only functions with an initializer hold a constant, the value of every other node is meaningless
+        if (snapshot.initializer(func.getFunction()) != nullptr)
+        {
+            const auto& layout = snapshot.layout(func.getType());
+            blt::u8 bytes[sizeof(blt::unsafe::any_t)]{};
+            layout.store(func.getValue(), bytes);
+            for (blt::size_t offset = 0; offset < layout.size; offset += sizeof(blt::u64))
+            {
+                blt::u64 chunk = 0;
+                std::memcpy(&chunk, bytes + offset, std::min(sizeof(blt::u64), layout.size - offset));
+                hash = combine(hash, chunk);
+            }
+        }
+        return hash;
+    }
+    
+    blt::u64 tree_t::combine_subtree(blt::size_t index) const
+    {
+        const auto& hashes = cache.hashes;
+        auto hash = hashes.keys[index];
+        // the first child directly follows its parent, every other child follows the subtree of the previous one
+        for (blt::size_t child = index + 1; child < index + hashes.sizes[index]; child += hashes.sizes[child])
+            hash = combine(hash, hashes.subtrees[child]);
+        return hash;
+    }
+    
+    void tree_t::rehash_ancestors(blt::size_t index, blt::u32 old_size, blt::u32 new_size)
+    {
+        auto& hashes = cache.hashes;
+        // ancestors are the earlier nodes whose subtree covers index, walking backwards finishes the deepest ones first
+        for (blt::size_t i = index; i-- > 0;)
+        {
+            if (i + hashes.sizes[i] <= index)
+                continue;
+            hashes.sizes[i] = hashes.sizes[i] - old_size + new_size;
+            hashes.subtrees[i] = combine_subtree(i);
+        }
+    }
+    
+    std::pair<blt::size_t, type_id> tree_t::select_typed_subtree(random& engine)
+    {
+        if (cache.type_index.dirty)
+            recalculate_type_index();
+        const auto& index = cache.type_index;
+        // every node is in exactly one bucket, so a uniform position in the index is a uniform node
+        const auto position = engine.random_long(0, index.nodes.size() - 1);
+        const auto bucket = std::upper_bound(index.offsets.begin() + 1, index.offsets.end(), position) - (index.offsets.begin() + 1);
+        return {index.nodes[position], static_cast<type_id>(bucket)};
+    }
+    
+    blt::span<const blt::u32> tree_t::nodes_of_type(type_id type)
+    {
+        if (cache.type_index.dirty)
+            recalculate_type_index();
+        const auto& index = cache.type_index;
+        return {index.nodes.data() + index.offsets[type], index.offsets[type + 1] - index.offsets[type]};
+    }
+    
+    void tree_t::recalculate_type_index()
+    {
+        auto& index = cache.type_index;
+        const auto type_count = types.snapshot().type_count();
+        
+        // type of every node in prefix order
+        std::vector<type_id> node_types;
+        for_each_node([&node_types](blt::size_t, const func_t& func) {
+            node_types.push_back(func.getType());
+        });
+        
+        // counting sort by type, which keeps the positions of each bucket in increasing order
+        index.offsets.assign(type_count + 1, 0);
+        for (auto type : node_types)
+            index.offsets[type + 1]++;
+        for (blt::size_t i = 1; i < index.offsets.size(); i++)
+            index.offsets[i] += index.offsets[i - 1];
+        index.nodes.resize(node_types.size());
+        std::vector<blt::u32> next(index.offsets.begin(), index.offsets.end() - 1);
+        for (blt::size_t i = 0; i < node_types.size(); i++)
+            index.nodes[next[node_types[i]]++] = static_cast<blt::u32>(i);
+        index.dirty = false;
+    }
+    
     void tree_t::recalculate_cache()
     {
         using detail::node_t;
         blt::size_t depth = 0;
         blt::size_t node_count = 0;
-        std::stack<std::pair<node_t*, std::size_t>> nodes;
-        
-        nodes.emplace(root, 1);
-        
-        while (!nodes.empty())
-        {
-            auto top = nodes.top();
-            auto* node = top.first;
-            auto d = top.second;
-            node_count++;
-            depth = std::max(d, depth);
-            nodes.pop();
-            for (blt::size_t i = 0; i < node->type.argc(); i++)
-                nodes.emplace(node->children[i], d + 1);
+        blt::size_t max_argc = 0;
+        switch (storage)
+        {
+            case tree_storage_t::POINTER:
+            {
+                std::stack<std::pair<node_t*, std::size_t>> nodes;
+                cache.execution_order.clear();
+                
+                nodes.emplace(root, 1);
+                
+                while (!nodes.empty())
+                {
+                    auto top = nodes.top();
+                    auto* node = top.first;
+                    auto d = top.second;
+                    node_count++;
+                    depth = std::max(d, depth);
+                    max_argc = std::max(node->type.argc(), max_argc);
+                    cache.execution_order.push_back(node);
+                    nodes.pop();
+                    for (blt::size_t i = 0; i < node->type.argc(); i++)
+                        nodes.emplace(node->children[i], d + 1);
+                }
+                // parents are always visited before their children, reversing gives us a valid post-order
+                std::reverse(cache.execution_order.begin(), cache.execution_order.end());
+                break;
+            }
+            case tree_storage_t::FLAT:
+            {
+                // depth of each finished subtree, the top of the stack being the first child of the next node
+                std::vector<blt::size_t> depths;
+                for (blt::size_t i = nodes.size(); i-- > 0;)
+                {
+                    blt::size_t d = 0;
+                    max_argc = std::max<blt::size_t>(nodes[i].argc, max_argc);
+                    for (blt::size_t j = 0; j < nodes[i].argc; j++)
+                    {
+                        d = std::max(d, depths.back());
+                        depths.pop_back();
+                    }
+                    depths.push_back(d + 1);
+                }
+                node_count = nodes.size();
+                depth = depths.back();
+                break;
+            }
+        }
+        cache.arguments.reserve(max_argc);
+        const auto& snapshot = types.snapshot();
+        if (cache.values.size() != snapshot.type_count())
+        {
+            cache.values.resize(snapshot.type_count());
+            for (type_id id = 0; id < cache.values.size(); id++)
+                cache.values[id].stride = snapshot.layout(id).size;
         }
         cache.dirty = false;
         cache.depth = depth;
         cache.node_count = node_count;
     }
-    
-    
+
+
 }
\ No newline at end of file
@@ -16,35 +16,267 @@
  *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include <lilfbtf/type.h>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 
 namespace fb
 {
+    namespace detail
+    {
+        // vose's method, every column is filled to the average weight using at most one other index
+        alias_table_t::alias_table_t(const std::vector<double>& weights): probability(weights.size()), alias(weights.size())
+        {
+            const auto count = weights.size();
+            if (count == 0)
+                return;
+            const auto total = std::accumulate(weights.begin(), weights.end(), 0.0);
+            // weights are validated when they are set, but a list which cannot be normalized is still sampled uniformly rather than with NaNs
+            if (!(total > 0) || !std::isfinite(total))
+            {
+                for (blt::u32 i = 0; i < count; i++)
+                {
+                    probability[i] = 1.0;
+                    alias[i] = i;
+                }
+                return;
+            }
+            std::vector<double> scaled(count);
+            std::vector<blt::u32> small;
+            std::vector<blt::u32> large;
+            for (blt::u32 i = 0; i < count; i++)
+            {
+                scaled[i] = weights[i] * static_cast<double>(count) / total;
+                (scaled[i] < 1.0 ? small : large).push_back(i);
+            }
+            while (!small.empty() && !large.empty())
+            {
+                auto s = small.back();
+                small.pop_back();
+                auto l = large.back();
+                probability[s] = scaled[s];
+                alias[s] = l;
+                scaled[l] -= 1.0 - scaled[s];
+                if (scaled[l] < 1.0)
+                {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // whatever is left is only off from 1 due to rounding
+            for (auto i : large)
+            {
+                probability[i] = 1.0;
+                alias[i] = i;
+            }
+            for (auto i : small)
+            {
+                probability[i] = 1.0;
+                alias[i] = i;
+            }
+        }
+        
+        void type_snapshot_t::function_list_t::append(const std::vector<function_id>& list, const std::vector<double>& weights)
+        {
+            alias_table_t table{weights};
+            for (blt::size_t i = 0; i < list.size(); i++)
+            {
+                functions.push_back(list[i]);
+                probability.push_back(table.get_probability(i));
+                alias.push_back(table.get_alias(i));
+            }
+            offsets.push_back(static_cast<blt::u32>(functions.size()));
+        }
+    }
     
-    type_id type_engine_t::register_type(type_name type_name)
+    type_id type_engine_t::register_type(type_name type_name, detail::type_layout_t layout)
     {
+        ensure_not_frozen("type '" + type_name + "'");
         type_id id = type_to_name.size();
         type_to_name.push_back(type_name);
+        type_layouts.push_back(layout);
         name_to_type[type_name] = id;
         return id;
     }
     
-    function_id type_engine_t::register_function(function_name func_name, type_name output, const func_t_call_t& func, arg_c_t argc,
-                                                 std::optional<std::reference_wrapper<const func_t_init_t>> initializer)
+    function_id type_engine_t::add_function(function_name func_name, type_name output, detail::dispatch_t func, arg_c_t argc, bool terminal,
+                                            std::optional<std::reference_wrapper<const func_t_init_t>> initializer)
     {
+        ensure_not_frozen("function '" + func_name + "'");
         function_id id = function_to_name.size();
         type_id tid = get_type_id(output);
+        function_to_name.push_back(func_name);
         name_to_function[func_name] = id;
-        functions.insert(id, func);
-        non_terminals.at(tid).push_back(id);
-        all_non_terminals.emplace_back(tid, id);
+        function_outputs.insert(id, tid);
+        functions.push_back(func);
+        batch_functions.insert(id, nullptr);
+        if (terminal)
+            terminals.at(tid).push_back(id);
+        else
+        {
+            non_terminals.at(tid).push_back(id);
+            all_non_terminals.emplace_back(tid, id);
+        }
         function_argc.insert(id, argc);
+        function_weights.insert(id, 1.0);
         if (auto& init = initializer)
             function_initializer.insert({id, init.value()});
         return id;
     }
     
+    type_engine_t& type_engine_t::set_function_weight(function_name func_name, double weight)
+    {
+        // a zero weight would make the total weight of a list zero, which the alias tables cannot be built from
+        if (!(weight > 0) || !std::isfinite(weight))
+            throw std::invalid_argument("Weight of function '" + func_name + "' must be positive and finite, got " + std::to_string(weight));
+        ensure_not_frozen("the weight of function '" + func_name + "'");
+        auto id = get_function_id(func_name);
+        function_weights.insert(id, weight);
+        return *this;
+    }
+    
+    const detail::type_snapshot_t& type_engine_t::freeze()
+    {
+        std::scoped_lock lock(freeze_mutex);
+        // the snapshot is never rebuilt once published, so references handed out by snapshot() stay valid for the engine's lifetime
+        if (!frozen.load(std::memory_order_relaxed))
+            build_snapshot();
+        return frozen_snapshot;
+    }
+    
+    void type_engine_t::ensure_not_frozen(const std::string& what) const
+    {
+        if (is_frozen())
+            throw std::logic_error("Cannot register " + what + " with a frozen type engine, register everything before building trees");
+    }
+    
+    void type_engine_t::build_snapshot()
+    {
+        detail::type_snapshot_t snapshot;
+        const auto type_count = static_cast<type_id>(type_to_name.size());
+        const auto function_count = static_cast<function_id>(function_to_name.size());
+        rebuild_closures();
+        
+        // every argument is eventually closed by select_closing, which has nothing to pick from for an unclosable type
+        std::string problems;
+        for (function_id id = 0; id < function_count; id++)
+        {
+            const auto& inputs = function_inputs.at(id);
+            if (inputs.size() != function_argc[id])
+                problems += "\n\tfunction '" + function_to_name[id] + "' takes " + std::to_string(function_argc[id]) + " arguments but has "
+                            + std::to_string(inputs.size()) + " argument types";
+            for (auto input : inputs)
+            {
+                if (min_closure_depth.at(input) == unclosable)
+                    problems += "\n\tfunction '" + function_to_name[id] + "' takes type '" + type_to_name[input]
+                                + "' which has no terminal and no function closing it";
+            }
+        }
+        if (!problems.empty())
+            throw std::logic_error("Type engine cannot be frozen:" + problems);
+        
+        snapshot.layouts = type_layouts;
+        snapshot.functions = functions;
+        for (function_id id = 0; id < function_count; id++)
+        {
+            snapshot.batch_functions.push_back(batch_functions[id]);
+            snapshot.initializers.push_back(function_initializer.contains(id) ? &function_initializer.at(id).get() : nullptr);
+            snapshot.outputs.push_back(function_outputs[id]);
+            snapshot.argc.push_back(static_cast<blt::u32>(function_argc[id]));
+            snapshot.weights.push_back(function_weights[id]);
+            for (auto type : function_inputs.at(id))
+                snapshot.argument_types.push_back(type);
+            snapshot.argument_offsets.push_back(static_cast<blt::u32>(snapshot.argument_types.size()));
+        }
+        
+        const auto weights_of = [this](const std::vector<function_id>& list) {
+            std::vector<double> weights;
+            for (auto id : list)
+                weights.push_back(function_weights[id]);
+            return weights;
+        };
+        for (type_id type = 0; type < type_count; type++)
+        {
+            const auto& terminal_list = terminals.at(type);
+            const auto& non_terminal_list = non_terminals.at(type);
+            snapshot.terminal_lists.append(terminal_list, weights_of(terminal_list));
+            snapshot.non_terminal_lists.append(non_terminal_list, weights_of(non_terminal_list));
+            
+            auto combined = non_terminal_list;
+            combined.insert(combined.end(), terminal_list.begin(), terminal_list.end());
+            snapshot.function_lists.append(combined, weights_of(combined));
+            
+            snapshot.closing_lists.append(closing_functions.at(type), weights_of(closing_functions.at(type)));
+        }
+        std::vector<function_id> any_non_terminal;
+        for (const auto& v : all_non_terminals)
+            any_non_terminal.push_back(v.second);
+        snapshot.any_non_terminal_list.append(any_non_terminal, weights_of(any_non_terminal));
+        
+        frozen_snapshot = std::move(snapshot);
+        frozen.store(true, std::memory_order_release);
+    }
+    
+    void type_engine_t::rebuild_closures()
+    {
+        const auto type_count = static_cast<type_id>(type_to_name.size());
+        const auto function_count = static_cast<function_id>(function_to_name.size());
+        for (type_id type = 0; type < type_count; type++)
+            min_closure_depth.at(type) = unclosable;
+        for (function_id id = 0; id < function_count; id++)
+            function_closure_depth.insert(id, unclosable);
+        
+        // depths only ever decrease, so relaxing every function until nothing changes finds the smallest ones.
+        // after pass k every type which closes within depth k has its final depth, which bounds the passes by the number of types.
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (function_id id = 0; id < function_count; id++)
+            {
+                const auto& inputs = function_inputs.at(id);
+                // functions whose inputs have not been associated yet cannot be used to close anything
+                if (inputs.size() != function_argc[id])
+                    continue;
+                blt::size_t depth = 1;
+                for (auto input : inputs)
+                    depth = std::max(depth, min_closure_depth.at(input) == unclosable ? unclosable : min_closure_depth.at(input) + 1);
+                if (depth >= function_closure_depth[id])
+                    continue;
+                function_closure_depth[id] = depth;
+                auto& type_depth = min_closure_depth.at(function_outputs[id]);
+                type_depth = std::min(type_depth, depth);
+                changed = true;
+            }
+        }
+        
+        for (type_id type = 0; type < type_count; type++)
+            closing_functions.at(type).clear();
+        for (function_id id = 0; id < function_count; id++)
+        {
+            const auto output = function_outputs[id];
+            if (function_closure_depth[id] != unclosable && function_closure_depth[id] == min_closure_depth.at(output))
+                closing_functions.at(output).push_back(id);
+        }
+    }
+    
+    function_id type_engine_t::register_function(function_name func_name, type_name output, const func_t_call_t& func, arg_c_t argc,
+                                                 std::optional<std::reference_wrapper<const func_t_init_t>> initializer)
+    {
+        return add_function(func_name, output, {nullptr, &func}, argc, false, initializer);
+    }
+    
+    function_id type_engine_t::register_function(function_name func_name, type_name output, func_t_call_ptr_t func, arg_c_t argc,
+                                                 std::optional<std::reference_wrapper<const func_t_init_t>> initializer)
+    {
+        return add_function(func_name, output, {func, nullptr}, argc, false, initializer);
+    }
+    
     type_engine_t& type_engine_t::associate_input(function_name func_name, const std::vector<std::string>& types)
     {
+        ensure_not_frozen("the inputs of function '" + func_name + "'");
         auto id = get_function_id(func_name);
         std::vector<type_id> type_ids;
         for (const auto& v : types)
@@ -53,17 +285,22 @@ namespace fb
         return *this;
     }
     
+    type_engine_t& type_engine_t::associate_batch(function_name func_name, const func_t_batch_call_t& func)
+    {
+        ensure_not_frozen("a batch function for '" + func_name + "'");
+        batch_functions.insert(get_function_id(func_name), &func);
+        return *this;
+    }
+    
     function_id type_engine_t::register_terminal_function(function_name func_name, type_name output, const func_t_call_t& func,
                                                           std::optional<std::reference_wrapper<const func_t_init_t>> initializer)
     {
-        function_id id = function_to_name.size();
-        type_id tid = get_type_id(output);
-        name_to_function[func_name] = id;
-        functions.insert(id, func);
-        terminals.at(tid).push_back(id);
-        function_argc.insert(id, 0);
-        if (auto& init = initializer)
-            function_initializer.insert({id, init.value()});
-        return id;
+        return add_function(func_name, output, {nullptr, &func}, 0, true, initializer);
+    }
+    
+    function_id type_engine_t::register_terminal_function(function_name func_name, type_name output, func_t_call_ptr_t func,
+                                                          std::optional<std::reference_wrapper<const func_t_init_t>> initializer)
+    {
+        return add_function(func_name, output, {func, nullptr}, 0, true, initializer);
     }
 }
\ No newline at end of file
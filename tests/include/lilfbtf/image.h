@@ -104,5 +104,4 @@ class image
         }
 };
 
-#endif //GP_IMAGE_TEST_IMAGE_H
 #endif //GP_IMAGE_TEST_IMAGE_H
\ No newline at end of file
@@ -0,0 +1,145 @@
+#pragma once
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LILFBTF5_TEST_COMMON_H
+#define LILFBTF5_TEST_COMMON_H
+
+#include <lilfbtf/tree.h>
+#include <lilfbtf/type.h>
+#include <lilfbtf/kernels.h>
+#include <blt/std/logging.h>
+#include <blt/std/types.h>
+
+// records a failed check without stopping the test, so one run reports every broken behaviour
+#define FB_CHECK(expr) fb::test::check(static_cast<bool>(expr), #expr, __FILE__, __LINE__)
+
+namespace fb::test
+{
+    inline blt::size_t& failed_checks()
+    {
+        static blt::size_t failed = 0;
+        return failed;
+    }
+    
+    inline bool check(bool passed, const char* expression, const char* file, int line)
+    {
+        if (!passed)
+        {
+            BLT_ERROR("%s:%d check failed: %s", file, line, expression);
+            failed_checks()++;
+        }
+        return passed;
+    }
+    
+    // the fitness case of the u8 GP, terminals read the coordinates of a pixel
+    struct pixel_t
+    {
+        blt::size_t x, y;
+    };
+    
+    inline const func_t_call_ptr_t add_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.get<blt::u8>(0) + args.get<blt::u8>(1));
+    };
+    inline const func_t_call_ptr_t sub_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.get<blt::u8>(0) - args.get<blt::u8>(1));
+    };
+    inline const func_t_call_ptr_t mul_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.get<blt::u8>(0) * args.get<blt::u8>(1));
+    };
+    inline const func_t_call_ptr_t div_f = [](const detail::func_t_arguments& args) {
+        auto dim = args.get<blt::u8>(1);
+        args.set<blt::u8>(dim == 0 ? 0 : args.get<blt::u8>(0) / dim);
+    };
+    inline const func_t_call_ptr_t if_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.get<bool>(0) ? args.get<blt::u8>(1) : args.get<blt::u8>(2));
+    };
+    inline const func_t_call_ptr_t less_f = [](const detail::func_t_arguments& args) {
+        args.set<bool>(args.get<blt::u8>(0) < args.get<blt::u8>(1));
+    };
+    inline const func_t_call_ptr_t not_f = [](const detail::func_t_arguments& args) { args.set<bool>(!args.get<bool>(0)); };
+    // registered as a std::function, so the dispatch table has to call through it rather than a plain function pointer
+    inline const func_t_call_t or_n_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.get<blt::u8>(0) | args.get<blt::u8>(1));
+    };
+    inline const func_t_call_ptr_t empty_f = [](const detail::func_t_arguments&) {};
+    inline const func_t_call_ptr_t coord_x_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.extra_args.any_cast<pixel_t>().x);
+    };
+    inline const func_t_call_ptr_t coord_y_f = [](const detail::func_t_arguments& args) {
+        args.set<blt::u8>(args.extra_args.any_cast<pixel_t>().y);
+    };
+    inline const func_t_init_t value_init_f = [](func_t& self, random& engine) {
+        self.setValue(static_cast<blt::u8>(engine.random_long(0, 255)));
+    };
+    
+    /**
+     * Registers the u8 image GP used by the behaviour tests, with batched kernels for every function that has one.
+     * The engine is left unfrozen.
+     */
+    inline void register_u8_gp(type_engine_t& engine)
+    {
+        engine.register_type<blt::u8>("u8");
+        engine.register_type<bool>("bool");
+        
+        engine.register_function("add", "u8", add_f, 2);
+        engine.register_function("sub", "u8", sub_f, 2);
+        engine.register_function("mul", "u8", mul_f, 2);
+        engine.register_function("div", "u8", div_f, 2);
+        engine.register_function("if", "u8", if_f, 3);
+        engine.register_function("or_n", "u8", or_n_f, 2);
+        engine.register_function("less", "bool", less_f, 2);
+        engine.register_function("not", "bool", not_f, 1);
+        
+        engine.register_terminal_function("value", "u8", empty_f, value_init_f);
+        engine.register_terminal_function("x", "u8", coord_x_f);
+        engine.register_terminal_function("y", "u8", coord_y_f);
+        
+        engine.associate_input("add", {"u8", "u8"});
+        engine.associate_input("sub", {"u8", "u8"});
+        engine.associate_input("mul", {"u8", "u8"});
+        engine.associate_input("div", {"u8", "u8"});
+        engine.associate_input("if", {"bool", "u8", "u8"});
+        engine.associate_input("or_n", {"u8", "u8"});
+        engine.associate_input("less", {"u8", "u8"});
+        engine.associate_input("not", {"bool"});
+        
+        engine.associate_batch("add", kernels::add_u8_batch);
+        engine.associate_batch("sub", kernels::sub_u8_batch);
+        engine.associate_batch("mul", kernels::mul_u8_batch);
+        engine.associate_batch("div", kernels::div_u8_batch);
+        engine.associate_batch("if", kernels::if_u8_batch);
+        engine.associate_batch("or_n", kernels::or_u8_batch);
+        engine.associate_batch("less", kernels::less_u8_batch);
+    }
+    
+    // fitness function for trees which are only evaluated for their result
+    inline const fitness_eval_func_t no_fitness = [](tree_t&) {
+        return detail::fitness_results{0, 0};
+    };
+    
+    /**
+     * @return the value produced by the root of a u8 tree for a single pixel
+     */
+    inline blt::u8 evaluate_u8(tree_t& tree, pixel_t pixel)
+    {
+        tree.evaluate(blt::unsafe::buffer_any_t{reinterpret_cast<blt::u8*>(&pixel)}, no_fitness);
+        return tree.result().value.any_cast<blt::u8>();
+    }
+}
+
+#endif //LILFBTF5_TEST_COMMON_H
@@ -8,8 +8,13 @@
 #include <lilfbtf/test4.h>
 #include "blt/profiling/profiler_v2.h"
 #include "lilfbtf/test5.h"
+#include <lilfbtf/test6.h>
+#include <lilfbtf/test7.h>
+#include <lilfbtf/test8.h>
+#include <lilfbtf/test_common.h>
 #include <lilfbtf/tree.h>
 #include <lilfbtf/type.h>
+#include <lilfbtf/kernels.h>
 #include <lilfbtf/image.h>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -31,67 +36,67 @@ struct pixel
 
 const blt::size_t image_width = 128, image_height = 128;
 
-const fb::func_t_call_t add_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() + args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t add_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.get<blt::u8>(0) + args.get<blt::u8>(1));
 };
-const fb::func_t_call_t sub_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() - args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t sub_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.get<blt::u8>(0) - args.get<blt::u8>(1));
 };
-const fb::func_t_call_t mul_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() * args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t mul_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.get<blt::u8>(0) * args.get<blt::u8>(1));
 };
-const fb::func_t_call_t div_f = [](const fb::detail::func_t_arguments& args) {
-    auto dim = args.arguments[1]->value().any_cast<blt::u8>();
+const fb::func_t_call_ptr_t div_f = [](const fb::detail::func_t_arguments& args) {
+    auto dim = args.get<blt::u8>(1);
     if (dim == 0)
-        args.self.setValue(0);
+        args.set<blt::u8>(0);
     else
-        args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() + dim);
+        args.set<blt::u8>(args.get<blt::u8>(0) / dim);
 };
 
-const fb::func_t_call_t empty_f = [](const fb::detail::func_t_arguments&) {};
-const fb::func_t_call_t coord_x_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.extra_args.any_cast<pixel>().x);
+const fb::func_t_call_ptr_t empty_f = [](const fb::detail::func_t_arguments&) {};
+const fb::func_t_call_ptr_t coord_x_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.extra_args.any_cast<pixel>().x);
 };
-const fb::func_t_call_t coord_y_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.extra_args.any_cast<pixel>().y);
+const fb::func_t_call_ptr_t coord_y_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.extra_args.any_cast<pixel>().y);
 };
-const fb::func_t_init_t value_init_f = [](fb::func_t& self) {
-    self.setValue(fb::random_value());
+const fb::func_t_init_t value_init_f = [](fb::func_t& self, fb::random& engine) {
+    self.setValue(static_cast<blt::u8>(engine.random_long(0, 255)));
 };
-const fb::func_t_init_t bool_init_f = [](fb::func_t& self) {
-    self.setValue(fb::choice());
+const fb::func_t_init_t bool_init_f = [](fb::func_t& self, fb::random& engine) {
+    self.setValue(engine.choice());
 };
-const fb::func_t_call_t if_f = [](const fb::detail::func_t_arguments& args) {
-    if (args.arguments[0]->value().any_cast<bool>())
-        args.self.setValue(args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t if_f = [](const fb::detail::func_t_arguments& args) {
+    if (args.get<bool>(0))
+        args.set<blt::u8>(args.get<blt::u8>(1));
     else
-        args.self.setValue(args.arguments[2]->value().any_cast<blt::u8>());
+        args.set<blt::u8>(args.get<blt::u8>(2));
 };
-const fb::func_t_call_t equals_b_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<bool>() == args.arguments[1]->value().any_cast<bool>());
+const fb::func_t_call_ptr_t equals_b_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<bool>(args.get<bool>(0) == args.get<bool>(1));
 };
-const fb::func_t_call_t equals_n_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() == args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t equals_n_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<bool>(args.get<blt::u8>(0) == args.get<blt::u8>(1));
 };
-const fb::func_t_call_t less_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() < args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t less_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<bool>(args.get<blt::u8>(0) < args.get<blt::u8>(1));
 };
-const fb::func_t_call_t greater_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() > args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t greater_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<bool>(args.get<blt::u8>(0) > args.get<blt::u8>(1));
 };
-const fb::func_t_call_t not_f = [](const fb::detail::func_t_arguments& args) { args.self.setValue(!args.arguments[0]->value().any_cast<bool>()); };
-const fb::func_t_call_t and_b_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<bool>() && args.arguments[1]->value().any_cast<bool>());
+const fb::func_t_call_ptr_t not_f = [](const fb::detail::func_t_arguments& args) { args.set<bool>(!args.get<bool>(0)); };
+const fb::func_t_call_ptr_t and_b_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<bool>(args.get<bool>(0) && args.get<bool>(1));
 };
-const fb::func_t_call_t or_b_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<bool>() || args.arguments[1]->value().any_cast<bool>());
+const fb::func_t_call_ptr_t or_b_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<bool>(args.get<bool>(0) || args.get<bool>(1));
 };
 
-const fb::func_t_call_t and_n_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() & args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t and_n_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.get<blt::u8>(0) & args.get<blt::u8>(1));
 };
-const fb::func_t_call_t or_n_f = [](const fb::detail::func_t_arguments& args) {
-    args.self.setValue(args.arguments[0]->value().any_cast<blt::u8>() | args.arguments[1]->value().any_cast<blt::u8>());
+const fb::func_t_call_ptr_t or_n_f = [](const fb::detail::func_t_arguments& args) {
+    args.set<blt::u8>(args.get<blt::u8>(0) | args.get<blt::u8>(1));
 };
 
 const fb::individual_eval_func_t image_gp_eval = [](fb::tree_t& tree) {
@@ -146,10 +151,20 @@ int main(int argc, const char** argv)
         //fb::test4();
         //fb::test5();
         
+        fb::test6();
+        fb::test7();
+        fb::test8();
+        if (fb::test::failed_checks() > 0)
+        {
+            BLT_ERROR("%lu behaviour checks failed", static_cast<unsigned long>(fb::test::failed_checks()));
+            return 1;
+        }
+        BLT_INFO("Every behaviour check passed");
+        
         fb::type_engine_t typeEngine;
         
-        typeEngine.register_type("u8");
-        typeEngine.register_type("bool");
+        typeEngine.register_type<blt::u8>("u8");
+        typeEngine.register_type<bool>("bool");
         
         typeEngine.register_function("add", "u8", add_f, 2);
         typeEngine.register_function("sub", "u8", sub_f, 2);
@@ -184,6 +199,18 @@ int main(int argc, const char** argv)
         typeEngine.associate_input("and_n", {"u8", "u8"});
         typeEngine.associate_input("or_n", {"u8", "u8"});
         
+        typeEngine.associate_batch("add", fb::kernels::add_u8_batch);
+        typeEngine.associate_batch("sub", fb::kernels::sub_u8_batch);
+        typeEngine.associate_batch("mul", fb::kernels::mul_u8_batch);
+        typeEngine.associate_batch("div", fb::kernels::div_u8_batch);
+        typeEngine.associate_batch("if", fb::kernels::if_u8_batch);
+        typeEngine.associate_batch("less", fb::kernels::less_u8_batch);
+        typeEngine.associate_batch("greater", fb::kernels::greater_u8_batch);
+        typeEngine.associate_batch("and_n", fb::kernels::and_u8_batch);
+        typeEngine.associate_batch("or_n", fb::kernels::or_u8_batch);
+        
+        typeEngine.freeze();
+        
         //BLT_PRINT_PROFILE("Tree Construction");
         //BLT_PRINT_PROFILE("Tree Evaluation");
         //BLT_PRINT_PROFILE("Tree Destruction");
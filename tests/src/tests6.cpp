@@ -0,0 +1,334 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lilfbtf/test6.h>
+#include <lilfbtf/test_common.h>
+#include <lilfbtf/kernels.h>
+#include <lilfbtf/primitive_set.h>
+#include <algorithm>
+#include <vector>
+
+namespace fb
+{
+    using test::pixel_t;
+    
+    namespace
+    {
+        constexpr tree_init_t init_types[] = {tree_init_t::GROW, tree_init_t::BRETT_GROW, tree_init_t::FULL};
+        
+        tree_t make_tree(type_engine_t& engine, blt::u64 seed, tree_storage_t storage, tree_init_t init = tree_init_t::GROW,
+                         blt::size_t min_depth = 2, blt::size_t max_depth = 6)
+        {
+            random random(seed);
+            return tree_t::make_tree({init, random, engine, 0.5, storage}, min_depth, max_depth, engine.get_type_id("u8"));
+        }
+        
+        // the same random choices build the same tree in either storage, which must then evaluate identically
+        void test_storage_agreement(type_engine_t& engine)
+        {
+            for (blt::u64 seed = 0; seed < 300; seed++)
+            {
+                const auto init = init_types[seed % 3];
+                auto pointer = make_tree(engine, seed, tree_storage_t::POINTER, init);
+                auto flat = make_tree(engine, seed, tree_storage_t::FLAT, init);
+                FB_CHECK(pointer.node_count() == flat.node_count());
+                FB_CHECK(pointer.depth() == flat.depth());
+                FB_CHECK(pointer.hash() == flat.hash());
+                for (blt::size_t p = 0; p < 16; p++)
+                {
+                    pixel_t pixel{p * 13, p * 7};
+                    FB_CHECK(test::evaluate_u8(pointer, pixel) == test::evaluate_u8(flat, pixel));
+                }
+            }
+        }
+        
+        // evaluating reuses the cached schedule, which has to follow the tree when it is modified
+        void test_cached_schedule(type_engine_t& engine)
+        {
+            for (blt::u64 seed = 0; seed < 100; seed++)
+            {
+                for (auto storage : {tree_storage_t::POINTER, tree_storage_t::FLAT})
+                {
+                    auto tree = make_tree(engine, seed, storage);
+                    const auto first = test::evaluate_u8(tree, {3, 4});
+                    FB_CHECK(test::evaluate_u8(tree, {3, 4}) == first);
+                    
+                    random random(seed + 1000);
+                    tree.mutate_subtree(random, 1, 3);
+                    auto copy = tree.copy();
+                    FB_CHECK(copy.node_count() == tree.node_count());
+                    FB_CHECK(test::evaluate_u8(tree, {3, 4}) == test::evaluate_u8(copy, {3, 4}));
+                }
+            }
+        }
+        
+        // a whole column of fitness cases at once must produce what evaluating every case on its own does
+        void test_batch_evaluation(type_engine_t& engine)
+        {
+            std::vector<pixel_t> pixels;
+            for (blt::size_t i = 0; i < 257; i++)
+                pixels.push_back({i % 29, i / 3});
+            std::vector<blt::unsafe::buffer_any_t> cases;
+            for (auto& pixel : pixels)
+                cases.emplace_back(reinterpret_cast<blt::u8*>(&pixel));
+            
+            for (blt::u64 seed = 0; seed < 100; seed++)
+            {
+                for (auto storage : {tree_storage_t::POINTER, tree_storage_t::FLAT})
+                {
+                    auto tree = make_tree(engine, seed, storage, init_types[seed % 3]);
+                    auto column = tree.evaluate_batch({cases.data(), cases.size()}, test::no_fitness);
+                    if (!FB_CHECK(column.size() == pixels.size()))
+                        continue;
+                    std::vector<blt::u8> batched(column.as<blt::u8>().begin(), column.as<blt::u8>().end());
+                    for (blt::size_t i = 0; i < pixels.size(); i++)
+                        FB_CHECK(batched[i] == test::evaluate_u8(tree, pixels[i]));
+                }
+            }
+        }
+        
+        // every length up to a few vector widths, starting off alignment, covers both the vector bodies and the scalar tails
+        void test_kernels()
+        {
+            random random(4);
+            std::vector<blt::u8> a(200), b(200), out(200);
+            std::vector<blt::u8> cond(200);
+            for (blt::size_t i = 0; i < a.size(); i++)
+            {
+                a[i] = static_cast<blt::u8>(random.random_long(0, 255));
+                // plenty of zeros for the division kernel
+                b[i] = static_cast<blt::u8>(i % 5 == 0 ? 0 : random.random_long(0, 255));
+                cond[i] = random.choice();
+            }
+            for (blt::size_t count = 0; count < 150; count++)
+            {
+                const auto* x = a.data() + 1;
+                const auto* y = b.data() + 1;
+                auto* o = out.data() + 1;
+                
+                kernels::add_u8(x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == static_cast<blt::u8>(x[i] + y[i]));
+                kernels::sub_u8(x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == static_cast<blt::u8>(x[i] - y[i]));
+                kernels::mul_u8(x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == static_cast<blt::u8>(x[i] * y[i]));
+                kernels::div_u8(x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == (y[i] == 0 ? 0 : x[i] / y[i]));
+                kernels::and_u8(x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == (x[i] & y[i]));
+                kernels::or_u8(x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == (x[i] | y[i]));
+                
+                bool results[200];
+                kernels::less_u8(x, y, results, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(results[i] == (x[i] < y[i]));
+                kernels::greater_u8(x, y, results, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(results[i] == (x[i] > y[i]));
+                
+                bool conditions[200];
+                for (blt::size_t i = 0; i < count; i++)
+                    conditions[i] = cond[i];
+                kernels::if_u8(conditions, x, y, o, count);
+                for (blt::size_t i = 0; i < count; i++)
+                    FB_CHECK(o[i] == (conditions[i] ? x[i] : y[i]));
+            }
+        }
+        
+        blt::u8 ps_add(blt::u8 a, blt::u8 b)
+        { return a + b; }
+        
+        blt::u8 ps_if(bool c, blt::u8 a, blt::u8 b)
+        { return c ? a : b; }
+        
+        bool ps_less(blt::u8 a, blt::u8 b)
+        { return a < b; }
+        
+        bool ps_not(bool a)
+        { return !a; }
+        
+        blt::u8 ps_x(blt::unsafe::buffer_any_t extra_args)
+        { return extra_args.any_cast<pixel_t>().x; }
+        
+        blt::u8 ps_value(random& random)
+        { return static_cast<blt::u8>(random.random_long(0, 255)); }
+        
+        // the jump table of a primitive set has to agree with the generic evaluator over the same trees
+        void test_primitive_set()
+        {
+            using set_t = primitive_set_t<type_list_t<blt::u8, bool>, primitive_t<&ps_add>, primitive_t<&ps_if>, primitive_t<&ps_less>,
+                    primitive_t<&ps_not>, primitive_t<&ps_x>, constant_t<blt::u8, &ps_value>>;
+            type_engine_t engine;
+            set_t set;
+            set.register_with(engine, {"u8", "bool"}, {"add", "if", "less", "not", "x", "value"});
+            engine.freeze();
+            
+            for (blt::u64 seed = 0; seed < 100; seed++)
+            {
+                auto tree = make_tree(engine, seed, tree_storage_t::FLAT, init_types[seed % 3]);
+                for (blt::size_t p = 0; p < 8; p++)
+                {
+                    pixel_t pixel{p * 31, 0};
+                    const auto expected = test::evaluate_u8(tree, pixel);
+                    FB_CHECK(set.evaluate<blt::u8>(tree, blt::unsafe::buffer_any_t{reinterpret_cast<blt::u8*>(&pixel)}) == expected);
+                }
+            }
+        }
+        
+        // the type index has to list every node under the type it produces, in prefix order
+        void check_type_index(type_engine_t& engine, tree_t& tree, random& random)
+        {
+            blt::size_t indexed = 0;
+            for (type_id type = 0; type < engine.get_type_count(); type++)
+            {
+                const auto nodes = tree.nodes_of_type(type);
+                indexed += nodes.size();
+                for (blt::size_t i = 1; i < nodes.size(); i++)
+                    FB_CHECK(nodes[i - 1] < nodes[i]);
+                if (tree.get_storage() == tree_storage_t::FLAT)
+                {
+                    const auto all = tree.subtree(0);
+                    for (auto index : nodes)
+                        FB_CHECK(all[index].type == type);
+                }
+            }
+            FB_CHECK(indexed == tree.node_count());
+            FB_CHECK(!tree.nodes_of_type(engine.get_type_id("u8")).empty());
+            FB_CHECK(tree.nodes_of_type(engine.get_type_id("u8"))[0] == 0);
+            
+            const auto [index, type] = tree.select_typed_subtree(random);
+            const auto candidates = tree.nodes_of_type(type);
+            FB_CHECK(std::find(candidates.begin(), candidates.end(), index) != candidates.end());
+        }
+        
+        void test_type_index(type_engine_t& engine)
+        {
+            for (blt::u64 seed = 0; seed < 200; seed++)
+            {
+                for (auto storage : {tree_storage_t::POINTER, tree_storage_t::FLAT})
+                {
+                    auto tree = make_tree(engine, seed, storage, init_types[seed % 3]);
+                    random random(seed * 3 + 1);
+                    check_type_index(engine, tree, random);
+                    // a modified tree rebuilds its index on the next lookup
+                    tree.invalidate();
+                    check_type_index(engine, tree, random);
+                }
+            }
+        }
+        
+        // every operator must leave a well formed tree behind, whose type index and hash match its nodes
+        void test_mutation(type_engine_t& engine)
+        {
+            for (blt::u64 seed = 0; seed < 200; seed++)
+            {
+                for (auto storage : {tree_storage_t::POINTER, tree_storage_t::FLAT})
+                {
+                    auto tree = make_tree(engine, seed, storage);
+                    random random(seed * 7 + 1);
+                    // hashed up front so the mutations update the hashes incrementally
+                    tree.hash();
+                    for (blt::size_t step = 0; step < 10; step++)
+                    {
+                        switch ((seed + step) % 5)
+                        {
+                            case 0:
+                                FB_CHECK(tree.mutate_subtree(random, 1, 3));
+                                break;
+                            case 1:
+                                tree.mutate_point(random);
+                                break;
+                            case 2:
+                                tree.mutate_hoist(random);
+                                break;
+                            case 3:
+                                tree.mutate_shrink(random);
+                                break;
+                            default:
+                                tree.mutate_constant(random);
+                                break;
+                        }
+                        check_type_index(engine, tree, random);
+                        
+                        // the incrementally updated hash has to match hashing the whole tree again
+                        const auto incremental = tree.hash();
+                        tree.invalidate();
+                        FB_CHECK(incremental == tree.hash());
+                        
+                        auto copy = tree.copy();
+                        FB_CHECK(copy.hash() == tree.hash());
+                        FB_CHECK(test::evaluate_u8(tree, {9, 2}) == test::evaluate_u8(copy, {9, 2}));
+                    }
+                }
+            }
+        }
+        
+        // point mutations pick their replacement by function weight, a constant is replaced by x ten times as often as by y
+        void test_weighted_point_mutation()
+        {
+            type_engine_t engine;
+            test::register_u8_gp(engine);
+            engine.set_function_weight("x", 10);
+            const auto x = engine.get_function_id("x");
+            const auto y = engine.get_function_id("y");
+            const auto value = engine.get_function_id("value");
+            blt::size_t picked_x = 0;
+            blt::size_t picked_y = 0;
+            for (blt::u64 seed = 0; seed < 500; seed++)
+            {
+                auto tree = make_tree(engine, seed, tree_storage_t::FLAT);
+                random random(seed + 11);
+                const auto before = tree.subtree(0);
+                const std::vector<detail::flat_node_t> original(before.begin(), before.end());
+                if (!tree.mutate_point(random))
+                    continue;
+                const auto after = tree.subtree(0);
+                FB_CHECK(after.size() == original.size());
+                for (blt::size_t i = 0; i < after.size(); i++)
+                {
+                    if (original[i].function != value || after[i].function == value)
+                        continue;
+                    picked_x += after[i].function == x;
+                    picked_y += after[i].function == y;
+                }
+            }
+            FB_CHECK(picked_y > 0 && picked_x > 5 * picked_y);
+        }
+    }
+    
+    void test6()
+    {
+        type_engine_t engine;
+        test::register_u8_gp(engine);
+        engine.freeze();
+        
+        test_storage_agreement(engine);
+        test_cached_schedule(engine);
+        test_batch_evaluation(engine);
+        test_kernels();
+        test_primitive_set();
+        test_type_index(engine);
+        test_mutation(engine);
+        test_weighted_point_mutation();
+    }
+}
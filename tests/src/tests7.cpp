@@ -0,0 +1,371 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lilfbtf/test7.h>
+#include <lilfbtf/test_common.h>
+#include <lilfbtf/arena.h>
+#include <lilfbtf/random.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fb
+{
+    namespace
+    {
+        void test_random()
+        {
+            random a(42);
+            random b(42);
+            random other_stream(42, 1);
+            blt::size_t same_stream = 0;
+            for (blt::size_t i = 0; i < 1000; i++)
+            {
+                const auto value = a.next();
+                FB_CHECK(value == b.next());
+                same_stream += value == other_stream.next();
+            }
+            FB_CHECK(same_stream == 0);
+            
+            // every value of a small range is drawn, and nothing outside of it
+            std::vector<blt::size_t> seen(11);
+            for (blt::size_t i = 0; i < 10000; i++)
+            {
+                const auto value = a.random_long(5, 15);
+                if (FB_CHECK(value >= 5 && value <= 15))
+                    seen[value - 5]++;
+                const auto signed_value = a.random_int(-3, 3);
+                FB_CHECK(signed_value >= -3 && signed_value <= 3);
+                const auto real = a.random_double(2, 4);
+                FB_CHECK(real >= 2 && real < 4);
+            }
+            FB_CHECK(std::all_of(seen.begin(), seen.end(), [](blt::size_t count) { return count > 0; }));
+        }
+        
+        // the fallback used without a 128 bit integer or a multiply intrinsic has to agree with the native product
+        void test_wide_multiply()
+        {
+            random random(8);
+            const blt::u64 max = ~blt::u64(0);
+            const std::vector<std::pair<blt::u64, blt::u64>> edges{{0, 0}, {1, max}, {max, max}, {max, 2}, {0xFFFFFFFF, 0x100000001}};
+            for (blt::size_t i = 0; i < 10000 + edges.size(); i++)
+            {
+                const auto [a, b] = i < edges.size() ? edges[i] : std::pair{random.next(), random.next() >> (i % 64)};
+                blt::u64 low, portable_low;
+                const auto high = detail::mul_hi64(a, b, low);
+                FB_CHECK(high == detail::mul_hi64_portable(a, b, portable_low));
+                FB_CHECK(low == portable_low);
+                FB_CHECK(low == a * b);
+            }
+        }
+        
+        // the bulk fills feed tree construction, they have to stay in range and be reproducible like the scalar draws
+        void test_bulk_random()
+        {
+            random a(42);
+            std::vector<blt::u64> longs(333);
+            a.fill_long({longs.data(), longs.size()}, 10, 20);
+            FB_CHECK(std::all_of(longs.begin(), longs.end(), [](blt::u64 v) { return v >= 10 && v <= 20; }));
+            std::vector<double> doubles(333);
+            a.fill_double({doubles.data(), doubles.size()}, -1, 1);
+            FB_CHECK(std::all_of(doubles.begin(), doubles.end(), [](double v) { return v >= -1 && v < 1; }));
+            
+            // bulk fills are reproducible from the seed as well
+            std::vector<blt::u64> first(100), second(100);
+            random c(7), d(7);
+            c.fill({first.data(), first.size()});
+            d.fill({second.data(), second.size()});
+            FB_CHECK(first == second);
+            
+            // a split stream has to differ from its parent in the bulk fills as well, the tree builders only draw from those
+            random parent(11);
+            auto child = parent.split();
+            std::vector<blt::u64> parent_values(1000), child_values(1000);
+            parent.fill({parent_values.data(), parent_values.size()});
+            child.fill({child_values.data(), child_values.size()});
+            blt::size_t shared = 0;
+            for (blt::size_t i = 0; i < parent_values.size(); i++)
+                shared += parent_values[i] == child_values[i];
+            FB_CHECK(shared == 0);
+            FB_CHECK(parent.next() != child.next());
+            
+            // jumping is deterministic, so splitting the same generator twice produces the same streams
+            random again(11);
+            auto child_again = again.split();
+            std::vector<blt::u64> again_values(1000);
+            again.fill({again_values.data(), again_values.size()});
+            FB_CHECK(again_values == parent_values);
+            child_again.fill({again_values.data(), again_values.size()});
+            FB_CHECK(again_values == child_values);
+        }
+        
+        // counts how often each function is used by the flat trees built from engine
+        std::vector<blt::size_t> count_functions(type_engine_t& engine, blt::size_t trees)
+        {
+            std::vector<blt::size_t> counts(engine.snapshot().function_count());
+            for (blt::u64 seed = 0; seed < trees; seed++)
+            {
+                random random(seed);
+                auto tree = tree_t::make_tree({tree_init_t::GROW, random, engine, 0.5, tree_storage_t::FLAT}, 2, 4,
+                                              engine.get_type_id("u8"));
+                for (const auto& node : tree.subtree(0))
+                    counts[node.function]++;
+            }
+            return counts;
+        }
+        
+        void test_function_weights()
+        {
+            type_engine_t engine;
+            test::register_u8_gp(engine);
+            engine.set_function_weight("x", 10);
+            engine.freeze();
+            const auto counts = count_functions(engine, 500);
+            const auto x = counts[engine.get_function_id("x")];
+            const auto y = counts[engine.get_function_id("y")];
+            FB_CHECK(engine.get_function_weight(engine.get_function_id("x")) == 10);
+            // the expected ratio is 10, far enough from 1 that sampling noise never gets close
+            FB_CHECK(y > 0 && x > 5 * y);
+            
+            // weights which cannot be normalized are rejected, and leave the previous weight in place
+            for (auto weight : {0.0, -1.0, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()})
+            {
+                bool rejected = false;
+                try
+                {
+                    engine.set_function_weight("y", weight);
+                } catch (const std::invalid_argument&)
+                {
+                    rejected = true;
+                }
+                FB_CHECK(rejected);
+                FB_CHECK(engine.get_function_weight(engine.get_function_id("y")) == 1);
+            }
+            FB_CHECK(engine.is_frozen());
+        }
+        
+        // elements of a non-trivial type have to survive the array growing, and be destroyed with it
+        void test_associative_array()
+        {
+            associative_array<blt::size_t, std::vector<blt::u64>, true> array;
+            for (blt::size_t i = 0; i < 100; i++)
+                array.insert(i, std::vector<blt::u64>(i, i));
+            for (blt::size_t i = 0; i < 100; i++)
+                FB_CHECK(array[i].size() == i && std::all_of(array[i].begin(), array[i].end(), [i](blt::u64 v) { return v == i; }));
+            FB_CHECK(array.at(500).empty());
+        }
+        
+        void test_closures()
+        {
+            type_engine_t engine;
+            test::register_u8_gp(engine);
+            engine.freeze();
+            const auto u8 = engine.get_type_id("u8");
+            const auto boolean = engine.get_type_id("bool");
+            FB_CHECK(engine.get_min_closure_depth(u8) == 1);
+            // bool only has non-terminals, the shortest of which is less(u8, u8)
+            FB_CHECK(engine.get_min_closure_depth(boolean) == 2);
+            const auto& closing = engine.get_closing_functions(boolean);
+            FB_CHECK(closing.size() == 1 && closing[0] == engine.get_function_id("less"));
+            
+            // past the maximum depth every slot is closed by a closing function, which ends within the closure depth of its type.
+            // the root counts as depth 1 while the builders count it as 0, so the deepest tree is one level past that
+            const auto closure = std::max(engine.get_min_closure_depth(u8), engine.get_min_closure_depth(boolean));
+            for (blt::u64 seed = 0; seed < 300; seed++)
+            {
+                for (auto init : {tree_init_t::GROW, tree_init_t::BRETT_GROW, tree_init_t::FULL})
+                {
+                    const blt::size_t max_depth = 2 + seed % 6;
+                    random random(seed);
+                    auto tree = tree_t::make_tree({init, random, engine, 0.5, tree_storage_t::FLAT}, 2, max_depth, u8);
+                    FB_CHECK(tree.depth() <= max_depth + 1 + closure);
+                }
+            }
+        }
+        
+        template<typename F>
+        bool throws_logic_error(F&& func)
+        {
+            try
+            {
+                func();
+            } catch (const std::logic_error&)
+            {
+                return true;
+            }
+            return false;
+        }
+        
+        // a type without terminals which only produces itself can never be closed, nothing may try to build a subtree of it
+        void test_unclosable()
+        {
+            {
+                type_engine_t engine;
+                test::register_u8_gp(engine);
+                engine.register_type<blt::u8>("matrix");
+                engine.register_function("grow_matrix", "matrix", test::empty_f, 1);
+                engine.register_function("trace", "u8", test::empty_f, 1);
+                engine.associate_input("grow_matrix", {"matrix"});
+                engine.associate_input("trace", {"matrix"});
+                FB_CHECK(throws_logic_error([&engine]() { engine.freeze(); }));
+                FB_CHECK(engine.get_min_closure_depth(engine.get_type_id("matrix")) == type_engine_t::unclosable);
+                FB_CHECK(!engine.is_frozen());
+            }
+            {
+                // argument types were never associated
+                type_engine_t engine;
+                test::register_u8_gp(engine);
+                engine.register_function("unassociated", "u8", test::empty_f, 2);
+                FB_CHECK(throws_logic_error([&engine]() { engine.freeze(); }));
+            }
+            {
+                // unused unclosable types are allowed, but cannot be used to start a tree
+                type_engine_t engine;
+                test::register_u8_gp(engine);
+                engine.register_type<blt::u8>("matrix");
+                engine.freeze();
+                random random(5);
+                FB_CHECK(throws_logic_error([&]() {
+                    auto tree = tree_t::make_tree({tree_init_t::GROW, random, engine}, 2, 4, engine.get_type_id("matrix"));
+                }));
+            }
+        }
+        
+        // building a tree freezes an engine which was never frozen, after which the engine rejects anything changing the snapshot
+        void test_lazy_freeze()
+        {
+            type_engine_t engine;
+            test::register_u8_gp(engine);
+            const auto u8 = engine.get_type_id("u8");
+            
+            // many threads racing to freeze the engine have to agree on a single snapshot
+            std::vector<std::thread> threads;
+            std::vector<const detail::type_snapshot_t*> seen(4);
+            for (blt::size_t t = 0; t < seen.size(); t++)
+            {
+                threads.emplace_back([&engine, &seen, u8, t]() {
+                    random random(t);
+                    auto tree = tree_t::make_tree({tree_init_t::GROW, random, engine}, 2, 4, u8);
+                    seen[t] = &engine.snapshot();
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            FB_CHECK(engine.is_frozen());
+            FB_CHECK(std::all_of(seen.begin(), seen.end(), [&seen](const detail::type_snapshot_t* v) { return v == seen.front(); }));
+            
+            // builders and operators hold references to the snapshot, so it can never change underneath them
+            const auto* frozen = &engine.snapshot();
+            const auto before = frozen->function_count();
+            FB_CHECK(throws_logic_error([&engine]() { engine.register_terminal_function("z", "u8", test::empty_f); }));
+            FB_CHECK(throws_logic_error([&engine]() { engine.set_function_weight("x", 2); }));
+            FB_CHECK(throws_logic_error([&engine]() { engine.associate_input("add", {"u8", "u8"}); }));
+            FB_CHECK(throws_logic_error([&engine]() { engine.register_type<blt::u8>("matrix"); }));
+            FB_CHECK(engine.is_frozen());
+            FB_CHECK(&engine.freeze() == frozen && frozen->function_count() == before);
+            
+            // everything registered before the first tree is built is part of the lazily built snapshot
+            type_engine_t weighted;
+            test::register_u8_gp(weighted);
+            weighted.register_terminal_function("z", "u8", test::empty_f);
+            // with every other u8 terminal weighted out of the way, the new terminal closes almost every tree
+            for (const auto* name : {"value", "x", "y"})
+                weighted.set_function_weight(name, 1e-9);
+            FB_CHECK(!weighted.is_frozen());
+            random random(3);
+            auto tree = tree_t::make_tree({tree_init_t::FULL, random, weighted, 0.5, tree_storage_t::FLAT}, 2, 2, u8);
+            FB_CHECK(weighted.is_frozen());
+            FB_CHECK(weighted.snapshot().function_count() == before + 1);
+            const auto z = weighted.get_function_id("z");
+            const auto nodes = tree.subtree(0);
+            FB_CHECK(std::any_of(nodes.begin(), nodes.end(), [z](const auto& node) { return node.function == z; }));
+        }
+        
+        void test_arena()
+        {
+            tree_arena_t arena(1024);
+            auto* small = static_cast<blt::u8*>(arena.allocate(3, 1));
+            auto* aligned = arena.allocate(24, 16);
+            FB_CHECK(reinterpret_cast<std::uintptr_t>(aligned) % 16 == 0);
+            FB_CHECK(static_cast<void*>(small) != aligned);
+            // larger than a slab, gets a slab of its own
+            auto* large = static_cast<blt::u8*>(arena.allocate(4096, 8));
+            std::fill(large, large + 4096, 1);
+            FB_CHECK(arena.reserved() >= 4096 + 1024);
+            // reset keeps the slabs, the same allocations afterwards fit into them without reserving anything new
+            const auto reserved = arena.reserved();
+            arena.reset();
+            FB_CHECK(arena.reserved() == reserved);
+            FB_CHECK(static_cast<blt::u8*>(arena.allocate(3, 1)) != nullptr);
+            FB_CHECK(reinterpret_cast<std::uintptr_t>(arena.allocate(24, 16)) % 16 == 0);
+            large = static_cast<blt::u8*>(arena.allocate(4096, 8));
+            std::fill(large, large + 4096, 2);
+            FB_CHECK(arena.reserved() == reserved);
+            
+            // more arenas than a thread caches slabs for, used in turn, each keep filling their first slab
+            std::vector<std::unique_ptr<tree_arena_t>> single_threaded;
+            for (blt::size_t i = 0; i < 8; i++)
+                single_threaded.push_back(std::make_unique<tree_arena_t>(4096, false));
+            for (blt::size_t round = 0; round < 200; round++)
+            {
+                for (auto& single : single_threaded)
+                    *single->emplace<blt::u64>() = round;
+            }
+            FB_CHECK(std::all_of(single_threaded.begin(), single_threaded.end(), [](auto& single) { return single->reserved() == 4096; }));
+            single_threaded.front()->reset();
+            for (blt::size_t round = 0; round < 200; round++)
+                FB_CHECK(*single_threaded.front()->emplace<blt::u64>(round) == round);
+            FB_CHECK(single_threaded.front()->reserved() == 4096);
+            
+            // every thread allocates from its own slab, no two allocations may overlap
+            constexpr blt::size_t per_thread = 2000;
+            std::vector<std::vector<blt::u64*>> allocations(4);
+            std::vector<std::thread> threads;
+            for (blt::size_t t = 0; t < allocations.size(); t++)
+            {
+                threads.emplace_back([&arena, &allocations, t]() {
+                    for (blt::size_t i = 0; i < per_thread; i++)
+                        allocations[t].push_back(arena.emplace<blt::u64>(t * per_thread + i));
+                });
+            }
+            for (auto& thread : threads)
+                thread.join();
+            for (blt::size_t t = 0; t < allocations.size(); t++)
+            {
+                for (blt::size_t i = 0; i < per_thread; i++)
+                    FB_CHECK(*allocations[t][i] == t * per_thread + i);
+            }
+        }
+    }
+    
+    void test7()
+    {
+        test_random();
+        test_wide_multiply();
+        test_bulk_random();
+        test_function_weights();
+        test_associative_array();
+        test_closures();
+        test_unclosable();
+        test_lazy_freeze();
+        test_arena();
+    }
+}
@@ -0,0 +1,294 @@
+/*
+ *  Copyright (C) 2024  Brett Terpstra
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <lilfbtf/test8.h>
+#include <lilfbtf/test_common.h>
+#include <lilfbtf/system.h>
+#include <blt/std/thread.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+namespace fb
+{
+    namespace
+    {
+        constexpr blt::size_t case_count = 3;
+        
+        const individual_eval_func_t evaluate_individual = [](tree_t& tree) {
+            test::evaluate_u8(tree, {5, 9});
+        };
+        
+        // higher values are fitter, and have a lower error on every case
+        const fitness_eval_func_t value_fitness = [](tree_t& tree) {
+            return detail::fitness_results{static_cast<double>(tree.result().value.any_cast<blt::u8>()), 0};
+        };
+        
+        const case_error_func_t value_errors = [](tree_t& tree, blt::span<float> errors) {
+            for (auto& error : errors)
+                error = 255.0f - static_cast<float>(tree.result().value.any_cast<blt::u8>());
+        };
+        
+        // the same population has to be scored the same no matter how many threads execute it
+        void test_parallel_execute(type_engine_t& engine)
+        {
+            blt::thread_pool<true> pool(4);
+            std::vector<double> fitness[2];
+            for (blt::size_t threads : {1, 4})
+            {
+                random random(31);
+                gp_population_t population(pool, engine, random, threads);
+                population.init_pop(population_init_t::GROW, 500, 2, 5, engine.get_type_id("u8"), 0.5, tree_storage_t::FLAT);
+                population.execute(evaluate_individual, value_fitness);
+                fitness[threads == 4] = population.get_fitness();
+                FB_CHECK(fitness[threads == 4].size() == 500);
+                
+                // a throwing evaluation reaches the caller once every worker has stopped, and leaves the population usable
+                bool thrown = false;
+                try
+                {
+                    population.execute([](tree_t& tree) {
+                        if (tree.node_count() % 3 == 0)
+                            throw std::runtime_error("evaluation failed");
+                        evaluate_individual(tree);
+                    }, value_fitness);
+                } catch (const std::runtime_error&)
+                {
+                    thrown = true;
+                }
+                FB_CHECK(thrown);
+                population.execute(evaluate_individual, value_fitness);
+                FB_CHECK(population.get_fitness() == fitness[threads == 4]);
+            }
+            FB_CHECK(fitness[0] == fitness[1]);
+            pool.stop();
+        }
+        
+        struct history_t
+        {
+            std::vector<std::vector<double>> fitness;
+            std::vector<std::vector<blt::u32>> sizes;
+        };
+        
+        history_t run_generations(type_engine_t& engine, blt::size_t threads, tree_storage_t storage, selection_t selection)
+        {
+            blt::thread_pool<true> pool(threads);
+            random random(1234);
+            gp_population_t population(pool, engine, random, threads);
+            population.init_pop(population_init_t::RAMPED_HALF_HALF, 300, 2, 6, engine.get_type_id("u8"), 0.5, storage);
+            history_t history;
+            for (blt::size_t generation = 0; generation < 5; generation++)
+            {
+                population.execute(evaluate_individual, value_fitness, case_count, value_errors);
+                history.fitness.push_back(population.get_fitness());
+                history.sizes.push_back(population.get_sizes());
+                population.breed_new_pop(0.8, 0.1, 5, selection);
+            }
+            pool.stop();
+            return history;
+        }
+        
+        // every random choice is drawn from streams tied to blocks of individuals, not to threads
+        void test_determinism(type_engine_t& engine)
+        {
+            for (auto storage : {tree_storage_t::POINTER, tree_storage_t::FLAT})
+            {
+                for (auto selection : {selection_t::TOURNAMENT, selection_t::EPSILON_LEXICASE})
+                {
+                    const auto serial = run_generations(engine, 1, storage, selection);
+                    const auto parallel = run_generations(engine, 4, storage, selection);
+                    FB_CHECK(serial.fitness == parallel.fitness);
+                    FB_CHECK(serial.sizes == parallel.sizes);
+                    for (const auto& sizes : serial.sizes)
+                        FB_CHECK(sizes.size() == 300);
+                }
+            }
+        }
+        
+        double median(std::vector<double> values)
+        {
+            const auto middle = values.begin() + static_cast<std::ptrdiff_t>(values.size() / 2);
+            std::nth_element(values.begin(), middle, values.end());
+            return *middle;
+        }
+        
+        // with reproduction only, the offspring are exactly the selected parents
+        void test_selection(type_engine_t& engine)
+        {
+            blt::thread_pool<true> pool(4);
+            for (auto selection : {selection_t::TOURNAMENT, selection_t::LEXICASE, selection_t::EPSILON_LEXICASE})
+            {
+                random random(99);
+                gp_population_t population(pool, engine, random, 4);
+                population.init_pop(population_init_t::RAMPED_HALF_HALF, 400, 2, 5, engine.get_type_id("u8"));
+                population.execute(evaluate_individual, value_fitness, case_count, value_errors);
+                const auto parents = population.get_fitness();
+                const auto best = *std::max_element(parents.begin(), parents.end());
+                
+                population.breed_new_pop(0, 0, 7, selection);
+                population.execute(evaluate_individual, value_fitness, case_count, value_errors);
+                const auto& offspring = population.get_fitness();
+                FB_CHECK(offspring.size() == parents.size());
+                FB_CHECK(std::all_of(offspring.begin(), offspring.end(), [&parents](double v) {
+                    return std::find(parents.begin(), parents.end(), v) != parents.end();
+                }));
+                
+                switch (selection)
+                {
+                    case selection_t::TOURNAMENT:
+                    {
+                        const auto mean = [](const std::vector<double>& v) { return std::accumulate(v.begin(), v.end(), 0.0) / v.size(); };
+                        FB_CHECK(mean(offspring) > mean(parents));
+                        break;
+                    }
+                    case selection_t::LEXICASE:
+                        // the best individual has the lowest error on every case, so it is the only one ever selected
+                        FB_CHECK(std::all_of(offspring.begin(), offspring.end(), [best](double v) { return v == best; }));
+                        break;
+                    case selection_t::EPSILON_LEXICASE:
+                    {
+                        // every case keeps the individuals within the median absolute deviation of the best error
+                        const auto centre = median(parents);
+                        std::vector<double> deviations;
+                        for (auto v : parents)
+                            deviations.push_back(std::abs(v - centre));
+                        const auto epsilon = median(deviations);
+                        FB_CHECK(std::all_of(offspring.begin(), offspring.end(), [best, epsilon](double v) { return v >= best - epsilon; }));
+                        break;
+                    }
+                }
+            }
+            pool.stop();
+        }
+        
+        // reproduction only fills the population with copies of a few parents, which are only executed once with deduplication
+        void test_deduplication(type_engine_t& engine)
+        {
+            blt::thread_pool<true> pool(4);
+            std::vector<double> fitness[2];
+            blt::size_t executed[2];
+            for (bool deduplicate : {false, true})
+            {
+                random random(23);
+                gp_population_t population(pool, engine, random, 4);
+                population.set_deduplication(deduplicate);
+                population.init_pop(population_init_t::RAMPED_HALF_HALF, 300, 2, 5, engine.get_type_id("u8"));
+                population.execute(evaluate_individual, value_fitness);
+                population.breed_new_pop(0, 0, 7);
+                std::atomic<blt::size_t> count = 0;
+                population.execute([&count](tree_t& tree) {
+                    count++;
+                    evaluate_individual(tree);
+                }, value_fitness);
+                fitness[deduplicate] = population.get_fitness();
+                executed[deduplicate] = count.load();
+            }
+            FB_CHECK(executed[false] == 300);
+            FB_CHECK(executed[true] < executed[false]);
+            FB_CHECK(fitness[false] == fitness[true]);
+            pool.stop();
+        }
+        
+        // crossover and mutation keep adding depth over the generations unless the offspring are limited
+        void test_depth_limit(type_engine_t& engine)
+        {
+            constexpr blt::size_t limit = 8;
+            blt::thread_pool<true> pool(4);
+            random random(17);
+            gp_population_t population(pool, engine, random, 4);
+            population.set_depth_limit(limit);
+            population.init_pop(population_init_t::RAMPED_HALF_HALF, 200, 2, 4, engine.get_type_id("u8"));
+            std::atomic<blt::size_t> deepest = 0;
+            const individual_eval_func_t record_depth = [&deepest](tree_t& tree) {
+                test::evaluate_u8(tree, {5, 9});
+                auto depth = tree.depth();
+                auto current = deepest.load();
+                while (depth > current && !deepest.compare_exchange_weak(current, depth))
+                {}
+            };
+            population.execute(record_depth, value_fitness);
+            // every initial tree has to fit within the limit for it to be meaningful
+            FB_CHECK(deepest.load() <= limit);
+            for (blt::size_t generation = 0; generation < 30; generation++)
+            {
+                population.breed_new_pop(0.7, 0.3, 3);
+                population.execute(record_depth, value_fitness);
+            }
+            FB_CHECK(deepest.load() <= limit);
+            pool.stop();
+        }
+        
+        // every key of a small cache has somewhere to go, and the cache never holds more than its capacity
+        void test_fitness_cache()
+        {
+            const std::vector<float> errors{1, 2};
+            std::vector<float> found_errors(errors.size());
+            detail::fitness_results found{};
+            for (blt::size_t capacity : {1, 3, 17, 100})
+            {
+                fitness_cache_t cache(capacity);
+                random random(capacity);
+                blt::size_t missing = 0;
+                for (blt::size_t i = 0; i < 200; i++)
+                {
+                    const auto hash = random.next();
+                    cache.insert(hash, {static_cast<double>(i), i}, {errors.data(), errors.size()});
+                    missing += !cache.find(hash, found, {found_errors.data(), found_errors.size()});
+                }
+                FB_CHECK(missing == 0);
+                FB_CHECK(cache.size() == capacity);
+                FB_CHECK(cache.evictions() == 200 - capacity);
+                FB_CHECK(cache.hits() == 200 && cache.misses() == 0);
+            }
+            
+            // hashes with the same top bits share a shard, which holds two entries with a capacity of 32
+            for (auto eviction : {eviction_t::LRU, eviction_t::FIFO})
+            {
+                fitness_cache_t cache(32, eviction);
+                const auto insert = [&](blt::u64 hash) { cache.insert(hash, {static_cast<double>(hash), 0}, {errors.data(), errors.size()}); };
+                const auto contains = [&](blt::u64 hash) { return cache.find(hash, found, {found_errors.data(), found_errors.size()}); };
+                insert(1);
+                insert(2);
+                FB_CHECK(contains(1) && found.fitness == 1 && found_errors == errors);
+                insert(3);
+                FB_CHECK(cache.evictions() == 1);
+                // LRU keeps the entry which was just found, FIFO evicts it as the oldest insertion
+                FB_CHECK(contains(1) == (eviction == eviction_t::LRU));
+                FB_CHECK(contains(2) == (eviction == eviction_t::FIFO));
+                FB_CHECK(contains(3));
+                // a lookup expecting a different number of case errors is a miss
+                FB_CHECK(!cache.find(3, found, {}));
+            }
+        }
+    }
+    
+    void test8()
+    {
+        type_engine_t engine;
+        test::register_u8_gp(engine);
+        engine.freeze();
+        
+        test_parallel_execute(engine);
+        test_determinism(engine);
+        test_selection(engine);
+        test_deduplication(engine);
+        test_depth_limit(engine);
+        test_fitness_cache();
+    }
+}